@@ -27,26 +27,289 @@
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
 
 /* Size of event buffer; filled by timer interrupt, emptied by main program. */
 #define BUFFER_SIZE 16
 
-/* Time a key must be stable (stopped bouncing) to generate an event. */
-#define STEADY_THRESH 5
+/* Size of the command buffer, filled by the UART RX interrupt. */
+#define COMMAND_BUFFER_SIZE 8
+
+/* Size of the transmit buffer, emptied by the UART data register empty
+ * interrupt. No more than sixteen, as frame ends are kept as bits. */
+#define TX_BUFFER_SIZE 16
+
+/* Size of the raw matrix buffer, in bytes. Must be a multiple of two. */
+#define RAW_BUFFER_SIZE 16
+
+/* Matrix layout, the A600 unless MATRIX_LAYOUT names a header, given at
+ * build time, which defines another.
+ *
+ * MATRIX_ROWS lists the rows: the row number, from 0, and the port and bits
+ * which drive it low. The metas have no row line, so no bits.
+ *
+ * MATRIX_BANKS lists the banks of up to eight columns: the bank number,
+ * from 0, the row, the port it is read on, the columns it has and the
+ * scancode of its column 0, a multiple of eight. Column n is that scancode
+ * plus n. Two banks can share a scancode if they have no columns in common.
+ * Scancodes from 0x60 are used for special codes, and 0x50 to 0x57 are the
+ * metas.
+ *
+ * MATRIX_SCANCODE_LIMIT is one past the highest scancode. */
+#ifdef MATRIX_LAYOUT
+#include MATRIX_LAYOUT
+#endif
+#ifndef MATRIX_ROWS
+#define MATRIX_ROWS(ROW) \
+	ROW(0, D, 0b00001000) \
+	ROW(1, D, 0b00010000) \
+	ROW(2, D, 0b00100000) \
+	ROW(3, D, 0b01000000) \
+	ROW(4, D, 0b10000000) \
+	ROW(5, D, 0)
+#define MATRIX_BANKS(BANK) \
+	BANK(0, 0, A, 0xff, 0x00) BANK(1, 0, B, 0x7f, 0x08) \
+	BANK(2, 1, A, 0xff, 0x10) BANK(3, 1, B, 0x7f, 0x18) \
+	BANK(4, 2, A, 0xff, 0x20) BANK(5, 2, B, 0x7f, 0x28) \
+	BANK(6, 3, A, 0xff, 0x30) BANK(7, 3, B, 0x7f, 0x38) \
+	BANK(8, 4, A, 0xff, 0x40) BANK(9, 4, B, 0x7f, 0x48) \
+	BANK(10, 5, C, 0xff, 0x50)
+#define MATRIX_SCANCODE_LIMIT 0x58
+#endif
+
+/* Number of rows and banks in the matrix. */
+#define COUNT_ROW(row, port, bits) + 1
+#define COUNT_BANK(bank, row, port, mask, base) + 1
+#define NUM_ROWS (0 MATRIX_ROWS(COUNT_ROW))
+#define NUM_BANKS (0 MATRIX_BANKS(COUNT_BANK))
+
+/* Check the layout. Bank numbers go in the low nibble of raw mode codes, and
+ * a bit each in rawdirty. A bit for each row (or bank) adds up to that many
+ * ones only if they are numbered from 0 with no gaps or repeats. */
+#define ROW_BIT(row, port, bits) + (1UL << (row))
+#define BANK_BIT(bank, row, port, mask, base) + (1UL << (bank))
+#define BANK_ROW_BIT(bank, row, port, mask, base) | (1UL << (row))
+#define BAD_BASE(bank, row, port, mask, base) || ((base) & 0x07) || \
+	(base) >= MATRIX_SCANCODE_LIMIT
+#if NUM_ROWS > 8
+#error "No more than eight rows can be scanned"
+#endif
+#if NUM_BANKS > 16
+#error "No more than sixteen banks can be scanned"
+#endif
+#if MATRIX_SCANCODE_LIMIT > 0x60
+#error "Scancodes from 0x60 are used for special codes"
+#endif
+#if (0 MATRIX_ROWS(ROW_BIT)) != (1UL << NUM_ROWS) - 1
+#error "Rows must be numbered from 0, without gaps"
+#endif
+#if (0 MATRIX_BANKS(BANK_BIT)) != (1UL << NUM_BANKS) - 1
+#error "Banks must be numbered from 0, without gaps"
+#endif
+#if (0 MATRIX_BANKS(BANK_ROW_BIT)) & ~((1UL << NUM_ROWS) - 1)
+#error "Every bank must be on one of the rows"
+#endif
+#if 0 MATRIX_BANKS(BAD_BASE)
+#error "Banks must start on a multiple of eight below MATRIX_SCANCODE_LIMIT"
+#endif
+
+/* SPI transport: built with SPI_TRANSPORT the controller is an SPI slave
+ * instead of using the UART. Every byte the host clocks in is a command
+ * byte, SPI_IDLE doing nothing between commands, and every byte clocked
+ * out is the next one the controller has to send, or SPI_IDLE if there is
+ * none. The SPI pins
+ * are PB4 to PB7, so the matrix mustn't use them, and there is no caps lock
+ * LED or auto baud. */
+#ifdef SPI_TRANSPORT
+#define SPI_IDLE 0xff
+#define SPI_PINS 0xf0
+#define PORT_IS_B_A 0
+#define PORT_IS_B_B 1
+#define PORT_IS_B_C 0
+#define PORT_IS_B_D 0
+#define PORT_IS_B_E 0
+#define SPI_ROW(row, port, bits) | (PORT_IS_B_##port ? (bits) : 0)
+#define SPI_BANK(bank, row, port, mask, base) | (PORT_IS_B_##port ? (mask) : 0)
+#if ((0 MATRIX_ROWS(SPI_ROW)) | (0 MATRIX_BANKS(SPI_BANK))) & SPI_PINS
+#error "The matrix uses the SPI pins"
+#endif
+#define CAPS_LED_ON()
+#define CAPS_LED_OFF()
+#define TX_START()
+#define RX_OFF() (SPCR &= ~(1 << SPIE))
+#define RX_ON() (SPCR |= (1 << SPIE))
+#else
+#define CAPS_LED_ON() (PORTB |= 0x80)
+#define CAPS_LED_OFF() (PORTB &= ~0x80)
+#define TX_START() (UCSRB |= (1 << UDRIE))
+#define RX_OFF() (UCSRB &= ~(1 << RXCIE))
+#define RX_ON() (UCSRB |= (1 << RXCIE))
+#endif
+
+/* Size of the high priority event buffer, for modifier events. Emptied
+ * before the main event buffer, so only used when that holds nothing but
+ * key ups. */
+#define PRIORITY_BUFFER_SIZE 4
+
+/* Time a key must be stable (stopped bouncing) to generate an event, in
+ * scans at the default scan rate. Keys which bounce more than this have
+ * their own, wider, threshold, up to the limit. */
+#define DEBOUNCE_MS 25
+#define STEADY_THRESH (DEBOUNCE_MS * DEFAULT_SCAN_RATE * SCAN_RATE_UNIT / 1000)
+#define MIN_STEADY_THRESH 2
+#define MAX_STEADY_THRESH 15
+
+/* A key's threshold is kept at least this much above the longest gap seen
+ * between bounces, and is lowered by one each time its press count fills
+ * up, if the press which filled it was clean, until it is back to the
+ * common one. Only WIDE_KEYS keys can have their own threshold at once. */
+#define STEADY_MARGIN 2
+#define WIDE_KEYS 8
+
+/* Number of keys which can be debounced at once. A key which changes while
+ * they are all in use is left until one is free. */
+#define DEBOUNCE_SLOTS 8
+
+/* Set in a key's debounce counter once it has been restarted, so the
+ * press can be counted as one which bounced. */
+#define STEADY_BOUNCED 0x80
+
+/* Time, in us, to let the columns settle after driving a row. Measured at
+ * power up, and on command, as twice the time the columns take to be
+ * pulled back up plus one, within these limits. DEFAULT_SETTLE_US is used if
+ * a column never comes back up. */
+#define DEFAULT_SETTLE_US 10
+#define MIN_SETTLE_US 1
+#define MAX_SETTLE_US 40
+#define DISCHARGE_US 5
+
+/* Settle time in timer ticks (Fcpu/8), rounded up. */
+#define SETTLE_TICKS(us) (((us) * (F_CPU / 1000000UL) + 7) / 8)
+
+/* CPU cycles allowed, in the fixed row sample times, for the scan interrupt
+ * to start and drive the first row, and from reading one row to driving
+ * the next. A row that is still driven late is read its settle time after
+ * it was driven instead. */
+#define SCAN_START_CYCLES 96
+#define ROW_GAP_CYCLES 64
+#define CYCLE_TICKS(cycles) (((cycles) + 7) / 8)
+
+/* Scan rate, in units of SCAN_RATE_UNIT Hz, and the timer compare value
+ * for it with the timer at Fcpu/8. */
+#define SCAN_RATE_UNIT 50
+#define DEFAULT_SCAN_RATE 4
+#define MIN_SCAN_RATE 1
+#define MAX_SCAN_RATE 20
+#define SCAN_OCR(rate) (F_CPU / 8 / ((rate) * SCAN_RATE_UNIT))
+
+/* While any key is changing or being debounced, scanning speeds up to the
+ * configured rate shifted left by the scan boost, as far as MAX_SCAN_RATE
+ * allows. Debounce counters count these faster scans, and thresholds, which
+ * are given in scans at the configured rate, are shifted to match, so they
+ * keep the same meaning in ms. */
+#define DEFAULT_SCAN_BOOST 1
+#define MAX_SCAN_BOOST 3
+
+/* When no key has changed for the idle timeout (in units of 100ms, 0 for
+ * never) scanning drops to IDLE_SCAN_RATE, and goes back up on the first
+ * change. */
+#define IDLE_SCAN_RATE 2
+#define DEFAULT_IDLE_TIMEOUT 10
+#define MAX_IDLE_TIMEOUT 15
+
+/* The main loop runs tasks: some when an interrupt flags that there is
+ * work for them, the others every so many ms of the Timer0 clock. The
+ * typematic task runs every TYPEMATIC_MS, and typematic timing is counted
+ * in runs of it. */
+#define TYPEMATIC_MS 1
+#define READY_EVENTS 0x01
+#define READY_OUTPUT 0x02
+#define READY_COMMANDS 0x04
+#define READY_AUTOBAUD 0x08
+
+/* Timer0 ticks, times eight, in a ms. */
+#define MS_TICKS (F_CPU / 32000UL)
 
 #define USART_BAUDRATE 9600
-#define BAUD_PRESCALE (((F_CPU / (USART_BAUDRATE * 16UL))) - 1)
+#define BAUD_PRESCALE (((F_CPU + USART_BAUDRATE * 8UL) / \
+	(USART_BAUDRATE * 16UL)) - 1)
+
+/* Actual baud rate, and how far out it is in tenths of a percent. */
+#define BAUD_ACTUAL (F_CPU / (16UL * (BAUD_PRESCALE + 1)))
+#define BAUD_ERROR ((BAUD_ACTUAL > USART_BAUDRATE ? \
+	BAUD_ACTUAL - USART_BAUDRATE : USART_BAUDRATE - BAUD_ACTUAL) * 1000 / \
+	USART_BAUDRATE)
+
+/* Auto baud: at power up, and on COM_AUTOBAUD, the host can send
+ * AUTOBAUD_SYNC at whatever rate it likes, over and over until it is
+ * answered. The falling edges of its alternating bits are timed on Timer1
+ * (Fcpu/8), between scans, and the UART switched to match. The controller
+ * looks for it for the given time, then carries on at the rate it had. Once
+ * locked the receiver stays off for AUTOBAUD_SETTLE_MS, so sync bytes
+ * still on their way aren't taken for commands. */
+#define AUTOBAUD_SYNC 0x55
+#define AUTOBAUD_EDGES 5
+#define AUTOBAUD_POWERUP_MS 500
+#define AUTOBAUD_COMMAND_MS 100
+#define AUTOBAUD_SETTLE_MS 20
+#define AUTOBAUD_OFF 0
+#define AUTOBAUD_TIMING 1
+#define AUTOBAUD_SETTLING 2
 
-/* Macro for obtaining a scancode from row, bank and column values. */
-#define GETSCAN(row, bank, col) ((row << 4) | (bank << 3) | col)
+/* Everything above is derived from F_CPU; make sure it still works out. */
+#if BAUD_ERROR > 20
+#error "Baud rate is more than 2% out at this F_CPU"
+#endif
+#if BAUD_PRESCALE > 4095
+#error "Baud rate is too low for this F_CPU"
+#endif
+#if SCAN_OCR(MIN_SCAN_RATE) > 65535
+#error "Slowest scan rate doesn't fit Timer1 at this F_CPU"
+#endif
+#if SCAN_OCR(IDLE_SCAN_RATE) > 65535
+#error "Idle scan rate doesn't fit Timer1 at this F_CPU"
+#endif
+#if SETTLE_TICKS(MAX_SETTLE_US) > 255
+#error "Longest settle time doesn't fit a byte of timer ticks at this F_CPU"
+#endif
+#if CYCLE_TICKS(SCAN_START_CYCLES) + NUM_ROWS * (CYCLE_TICKS(ROW_GAP_CYCLES) + \
+	SETTLE_TICKS(MAX_SETTLE_US)) >= SCAN_OCR(MAX_SCAN_RATE)
+#error "Fastest scan rate leaves no time to settle the rows at this F_CPU"
+#endif
+#if STEADY_THRESH < MIN_STEADY_THRESH || STEADY_THRESH > MAX_STEADY_THRESH
+#error "DEBOUNCE_MS is out of range at the default scan rate"
+#endif
+#if (MAX_STEADY_THRESH << MAX_SCAN_BOOST) + 1 >= STEADY_BOUNCED
+#error "Widest debounce threshold doesn't fit its counter at the biggest scan boost"
+#endif
+
+/* One past the highest scancode the matrix can produce. */
+#define SCANCODE_LIMIT MATRIX_SCANCODE_LIMIT
+
+/* Is the scancode (or event) one of the metas? */
+#define ISMETA(scancode) (((scancode) & 0x78) == 0x50)
+
+/* Is the key down, and finished bouncing? Whether or not its event has
+ * found room in the buffer yet. */
+#define KEYDOWN(scancode) (steadystate[(scancode) >> 3] & \
+	(1 << ((scancode) & 0x07)))
 
 /* Commands. */
 #define COM_TYPE_MASK 0b11000000
 #define COM_TYPE_REGULAR 0b00000000
 #define COM_TYPE_DELAY 0b01000000
 #define COM_TYPE_RATE 0b10000000
+#define COM_TYPE_CONFIG 0b11000000
 #define COM_VALUE_MASK 0b00111111
 
+/* Config commands: 1100vvvv sets the debounce threshold, 1101vvvv the idle
+ * timeout, 111vvvvv the scan rate. */
+#define COM_CONFIG_RATE 0b00100000
+#define COM_CONFIG_IDLE 0b00010000
+#define COM_CONFIG_VALUE_MASK 0b00011111
+#define COM_CONFIG_SMALL_VALUE_MASK 0b00001111
+
 #define COM_RED_LED_OFF 0
 #define COM_RED_LED_ON 1
 #define COM_GREEN_LED_OFF 2
@@ -54,336 +317,2732 @@
 #define COM_BLUE_LED_OFF 4
 #define COM_BLUE_LED_ON 5
 #define COM_INIT 6
+#define COM_TYPEMATIC_DEVICE 7
+#define COM_TYPEMATIC_HOST 8
+#define COM_TYPEMATIC_BATCHED 9
+#define COM_LEARN_CHORD_0 10
+#define COM_LEARN_CHORD_1 11
+#define COM_CLEAR_CHORDS 12
+#define COM_REPORT 13
+#define COM_REPORT_MODE 14
+#define COM_EVENT_MODE 15
+#define COM_RAW_MODE 16
+#define COM_STATS 17
+#define COM_CLEAR_STATS 18
+#define COM_CONFIG 19
+#define COM_CALIBRATE 20
+#define COM_SET_REMAP 21
+#define COM_CLEAR_REMAP 22
+#define COM_ASCII_MODE 23
+#define COM_SET_ASCII 24
+#define COM_SET_FN_KEY 25
+#define COM_SET_LAYER 26
+#define COM_CLEAR_LAYER 27
+#define COM_SET_MACRO 28
+#define COM_REGISTERS 29
+#define COM_LED_EFFECT 30
+#define COM_LED_BRIGHTNESS 31
+
+/* COM_RGB_LED sets all three LEDs at once: 00100RGB. */
+#define COM_RGB_LED 32
+#define COM_RGB_LED_LAST (COM_RGB_LED + 7)
+
+#define COM_AUTOBAUD 40
+
+/* Number of argument bytes which follow a regular command. */
+#define COMMAND_ARGS(command) ((command) == COM_SET_REMAP ? 2 : \
+	(command) == COM_SET_ASCII ? 3 : \
+	(command) == COM_SET_FN_KEY ? 2 : \
+	(command) == COM_SET_LAYER ? 2 : \
+	(command) == COM_SET_MACRO ? 3 : \
+	(command) == COM_REGISTERS ? 3 : \
+	(command) == COM_LED_EFFECT ? 3 : \
+	(command) == COM_LED_BRIGHTNESS ? 3 : 0)
+#define MAX_COMMAND_ARGS 3
 
 /* Special keys scancodes. */
 #define KEY_CAPS_LOCK 0x30
 
-/* Default typematic speeds. */
-#define DEFAULT_TYPEMATIC_DELAY (63 << 2)
-#define DEFAULT_TYPEMATIC_RATE (25 << 2)
+/* Default typematic speeds, in ms; commands set them in units of 4ms. */
+#define DEFAULT_TYPEMATIC_DELAY 252
+#define DEFAULT_TYPEMATIC_RATE 100
+
+/* Typematic modes: repeat on the controller, leave it to the host (edges
+ * only), or repeat on the controller but send batched repeat counts. */
+#define TYPEMATIC_DEVICE 0
+#define TYPEMATIC_HOST 1
+#define TYPEMATIC_BATCHED 2
+
+/* Batched repeat code: 0110nnnn, repeat the last key down n times. Row 6
+ * is not used by the matrix so this can't be confused with a scancode. */
+#define REPEAT_CODE 0b01100000
+#define REPEAT_BATCH_SIZE 4
+#define REPEAT_COUNT_MAX 15
+
+/* System chords: sets of keys which, when all held down, assert the signal
+ * line to the FPGA. Stored in EEPROM; unused key slots are NO_KEY. */
+#define NUM_CHORDS 2
+#define CHORD_KEYS 4
+#define NO_KEY 0xff
+
+/* Chord event: D111000N, chord N completed (D=0) or broken (D=1). */
+#define CHORD_CODE 0b01110000
+#define ISCHORD(event) (((event) & 0x70) == CHORD_CODE)
+
+/* Events a meta or chord mustn't overtake, as that would change what they
+ * mean: key downs, and other metas and chords. */
+#define ORDERED(event) (!((event) & 0b10000000) || ISMETA(event) || \
+	ISCHORD(event))
+
+/* Size of the flash keymap: every scancode the format allows, rows 0 to 5. */
+#define KEYMAP_SIZE 0x60
+
+/* Fn layer: while the Fn key is held, or after it is pressed in toggle
+ * mode, keys listed in the layer are sent as something else. The layer is a
+ * list of key and replacement pairs in EEPROM. */
+#define LAYER_ENTRIES 24
+#define FN_HOLD 0
+#define FN_TOGGLE 1
+
+/* Macros: byte sequences in EEPROM, sent when their trigger (a key or a
+ * chord event) goes down. Each slot has the trigger, the length and the
+ * bytes. */
+#define MACRO_SLOTS 4
+#define MACRO_LENGTH 30
+
+/* RGB LED, on PORTE: red, green and blue in bits 2 to 0. */
+#define LED_MASK 0x07
+#define LED_CHANNELS 3
+
+/* LED brightness, 0 to MAX_LED_LEVEL per channel, by binary code
+ * modulation on Timer0 (Fcpu/256): bit n of the level is shown for
+ * BCM_TICKS << n, so a frame of all the bits runs at about BCM_HZ. */
+#define BCM_BITS 4
+#define MAX_LED_LEVEL ((1 << BCM_BITS) - 1)
+#define BCM_HZ 250
+#define BCM_TICKS (F_CPU / 256 / (BCM_HZ * MAX_LED_LEVEL))
+
+/* The longest plane must fit the 8 bit timer. */
+#if BCM_TICKS < 1 || BCM_TICKS << (BCM_BITS - 1) > 255
+#error "LED brightness frame doesn't fit Timer0 at this F_CPU"
+#endif
+
+/* LED effects, run by the timer interrupt so the host doesn't have to keep
+ * sending LED commands. Each has two colours, A and B, and a period in
+ * steps of LED_STEP_MS:
+ *
+ * EFFECT_BLINK: A, then off
+ * EFFECT_ALTERNATE: A, then B
+ * EFFECT_PULSE: A for one period, then off for three
+ * EFFECT_SEQUENCE: every colour from A to B in turn, up or down
+ * EFFECT_FADE: A fading up and back down, a level each period */
+#define LED_STEP_MS 10
+#define EFFECT_NONE 0
+#define EFFECT_BLINK 1
+#define EFFECT_ALTERNATE 2
+#define EFFECT_PULSE 3
+#define EFFECT_SEQUENCE 4
+#define EFFECT_FADE 5
+#define EFFECT_LAST EFFECT_FADE
+
+/* Polled report: REPORT_CODE, a bitmap of the metas held, then up to
+ * REPORT_KEYS other scancodes held, padded with NO_KEY. If there are too
+ * many keys held to fit they are all REPORT_ROLLOVER. */
+#define REPORT_CODE 0b11100000
+#define REPORT_KEYS 6
+#define REPORT_ROLLOVER 0xfe
+#define REPORT_LENGTH (REPORT_KEYS + 2)
+
+/* What the host is sent: key events, nothing but polled reports, the raw
+ * matrix, or characters. */
+#define OUTPUT_EVENTS 0
+#define OUTPUT_REPORTS 1
+#define OUTPUT_RAW 2
+#define OUTPUT_ASCII 3
+
+/* Character layout entries. 0x01 to 0x7f are characters. 0x80 to 0xef are
+ * sent as ESC [ and the low seven bits, for cursor and function keys. The
+ * ASCII_SHIFT to ASCII_ALT values, in the unshifted entry, mark a key as a
+ * modifier. 0x00 sends nothing. In EEPROM, 0xff means no entry. */
+#define ASCII_ESCAPE 0x1b
+#define ASCII_CSI 0x80
+#define ASCII_SHIFT 0xf0
+#define ASCII_CTRL 0xf1
+#define ASCII_ALT 0xf2
+
+/* Modifiers held, as bits; ASCII_SHIFT is bit 0 and so on. */
+#define MOD_SHIFT 0x01
+#define MOD_CTRL 0x02
+#define MOD_ALT 0x04
+
+/* Raw matrix data is sent as pairs: RAW_CODE | bank, then the bank's
+ * column bits (0 = closed). */
+#define RAW_CODE 0b11010000
+
+/* Statistics dump: STATS_CODE, a byte per scancode, then the keys with
+ * their own thresholds, as pairs. */
+#define STATS_CODE 0b11100001
+
+/* Config report: CONFIG_CODE, debounce threshold, scan rate, idle
+ * timeout. */
+#define CONFIG_CODE 0b11100010
+
+/* Calibration report: CALIBRATION_CODE, then the settle time for each
+ * row. */
+#define CALIBRATION_CODE 0b11100011
+
+/* Sent when command bytes have been lost because the command buffer was
+ * full. The rest of the command they belonged to is dropped too, and any
+ * command waiting for its arguments or macro data is abandoned, so the
+ * next byte is taken as a new command. */
+#define OVERFLOW_CODE 0b11100101
+
+/* Sent once a command which writes to EEPROM, or a byte of macro data, has
+ * been dealt with. Each EEPROM byte takes around 8.5ms to write, so the
+ * host waits for this before sending the next, or the command buffer would
+ * fill up. */
+#define ACK_CODE 0b11100110
+
+/* Register file: settings are numbered registers, read and written with
+ * COM_REGISTERS, an operation, a register and a count or value. Reads are
+ * answered with REGISTERS_CODE, the first register, the count, then the
+ * values. A write is answered as a read of the register, so the host sees
+ * what was actually used. */
+#define REGISTERS_CODE 0b11100100
+#define REG_GET 0
+#define REG_SET 1
+
+#define REG_VERSION 0
+#define REG_CAPABILITIES 1
+#define REG_DEBOUNCE 2
+#define REG_SCAN_RATE 3
+#define REG_IDLE_TIMEOUT 4
+#define REG_TYPEMATIC_DELAY 5
+#define REG_TYPEMATIC_RATE 6
+#define REG_TYPEMATIC_MODE 7
+#define REG_OUTPUT_MODE 8
+#define REG_FN_KEY 9
+#define REG_FN_MODE 10
+#define REG_LEDS 11
+#define REG_FLOW_CONTROL 12
+#define REG_BAUD 13
+#define REG_SCAN_BOOST 14
+#define NUM_REGISTERS 15
+
+/* Protocol version, and what this build can do, in the read only
+ * registers. Unknown registers read as 0xff. */
+#define PROTOCOL_VERSION 1
+#define CAP_CHORDS 0x01
+#define CAP_REPORTS 0x02
+#define CAP_RAW 0x04
+#define CAP_KEYMAP 0x08
+#define CAP_FN_LAYER 0x10
+#define CAP_ASCII 0x20
+#define CAP_MACROS 0x40
+#define CAP_LED_EFFECTS 0x80
+#define CAPABILITIES (CAP_CHORDS | CAP_REPORTS | CAP_RAW | CAP_KEYMAP | \
+	CAP_FN_LAYER | CAP_ASCII | CAP_MACROS | CAP_LED_EFFECTS)
+
+/* Flow control: with it turned on, the host sends FLOW_XOFF to stop the
+ * controller sending and FLOW_XON to start it again. They are taken at any
+ * point, even among a command's arguments, so the host's UART can send them
+ * itself. As commands they would only be out of range scan rates. */
+#define FLOW_XOFF 0xfe
+#define FLOW_XON 0xfd
+
+/* Signal line to the FPGA, on PORTD. Active low. */
+#define SIGNAL_BIT 0x04
 
 /* Serial related. */
 void writechar(char c);
+void startframe(void);
+void endframe(void);
+void sendevent(unsigned char event);
+void sendascii(unsigned char event);
+unsigned char asciilookup(unsigned char scancode, unsigned char shifted);
+void makereport(void);
 void writestring(char *string);
+void startautobaud(unsigned int ms);
+unsigned char autobaud(void);
 char readchar(void);
 
+/* Tasks. */
+void eventtask(void);
+void typematictask(void);
+void outputtask(void);
+void commandtask(void);
+void ledtask(void);
+void autobaudtask(void);
+static inline void setready(unsigned char flags);
+
 /* Other local subs. */
 void initkeybuffer(void);
+unsigned char eventbacklog(void);
+static inline unsigned char queueevent(unsigned char event);
+static inline unsigned char getthresh(unsigned char scancode);
+void setthresh(unsigned char scancode, unsigned char thresh);
+static inline void notegap(unsigned char scancode, unsigned char gap);
+static inline unsigned char debounceslot(unsigned char scancode);
+static inline unsigned char startdebounce(unsigned char scancode);
+static inline void enddebounce(unsigned char slot, unsigned char down);
+unsigned char scanbank(unsigned char in, unsigned char mask,
+	unsigned char bank, unsigned char base);
+void sendstats(void);
+void loadchords(void);
+void loadconfig(void);
+void setsteadythresh(unsigned char thresh);
+void setscanrate(unsigned char rate);
+void setidletimeout(unsigned char timeout);
+void setscanboost(unsigned char boost);
+void sendconfig(void);
+unsigned char measurerise(volatile uint8_t *ddr, volatile uint8_t *port,
+	volatile uint8_t *pin, unsigned char mask);
+void calibratesettle(void);
+void sendcalibration(void);
+void learnchord(unsigned char event);
+unsigned char readcommand(void);
+void runcommandargs(void);
+unsigned char remapevent(unsigned char event);
+unsigned char layerlookup(unsigned char scancode);
+unsigned char fnkeyevent(unsigned char event);
+void loadfnkey(void);
+unsigned char getregister(unsigned char reg);
+void setregister(unsigned char reg, unsigned char value);
+void sendregisters(unsigned char first, unsigned char count);
+unsigned char macroevent(unsigned char event);
+void playmacro(void);
+void setleds(unsigned char colour);
+void showleds(void);
+void loadleds(void);
+void starteffect(unsigned char effect, unsigned char colours,
+	unsigned char period);
+static inline void stepeffect(void);
 
 /* GLOBALS */
 
+/* Tasks, in flash: what to run, the ready flag which runs it and its
+ * period in ms (0 for none). When each was last due is kept in RAM. */
+struct task
+{
+	void (*run)(void);
+	unsigned char ready;
+	unsigned char period;
+};
+
+const struct task tasks[] PROGMEM = {
+	{ eventtask, READY_EVENTS, 0 },
+	{ typematictask, 0, TYPEMATIC_MS },
+	{ outputtask, READY_OUTPUT, 0 },
+	{ commandtask, READY_COMMANDS, 0 },
+	{ ledtask, 0, LED_STEP_MS },
+	{ autobaudtask, READY_AUTOBAUD, 0 },
+};
+#define NUM_TASKS (sizeof(tasks) / sizeof(tasks[0]))
+unsigned int tasklast[NUM_TASKS];
+
+/* Ready flags set by the interrupts, and the ms clock kept by Timer0: the
+ * time, its remainder in eighths of a Timer0 tick, and the count it was last
+ * brought up to date at. */
+unsigned char readyflags = READY_EVENTS | READY_COMMANDS;
+unsigned int mstime = 0;
+unsigned int msticks = 0;
+unsigned char clocklast = 0;
+
+/* Auto baud state, and when the step it is on ends. */
+unsigned char autobaudstate = AUTOBAUD_OFF;
+unsigned int autobaudend = 0;
+
+/* Key event state: the last event, the time until it repeats, in runs of
+ * the typematic task, and batched repeats not yet sent. */
+unsigned char lastevent = 0;
+int keydowntimer = 0;
+unsigned char repeatpending = 0;
+
 /* Event buffer stuff. */
 unsigned char readpointer = 0;
 unsigned char writepointer = 0;
 unsigned char keybuffer[BUFFER_SIZE];
 
-/* Bitmap of scancodes. */
-unsigned char keystate[128 / 8];
+/* Transmit buffer, and a bit for each byte in it which ends a frame (a
+ * code and the bytes that go with it, which a report mustn't split). Also
+ * how many frames are being written, and whether the last byte sent ended
+ * a frame. */
+unsigned char txreadpointer = 0;
+unsigned char txwritepointer = 0;
+unsigned char txbuffer[TX_BUFFER_SIZE];
+unsigned int txends = 0;
+unsigned char txframe = 0;
+unsigned char txboundary = 1;
+
+/* Polled report: the keys held when it was asked for, how much of it has
+ * been sent (REPORT_LENGTH when none is waiting), and whether another was
+ * asked for while it was going out. */
+unsigned char report[REPORT_LENGTH];
+unsigned char reportpos = REPORT_LENGTH;
+unsigned char reportagain = 0;
+
+/* Command buffer. When a command doesn't fit, it is dropped: where it
+ * would have been, so the main loop can say so when it gets there, and
+ * whether the rest of its bytes are still to be thrown away as they
+ * arrive. Also where the command being received was stored, NO_KEY until
+ * its first byte is. */
+unsigned char commandreadpointer = 0;
+unsigned char commandwritepointer = 0;
+unsigned char commandbuffer[COMMAND_BUFFER_SIZE];
+unsigned char commandoverflow = 0;
+unsigned char commandcut = 0;
+unsigned char commanddropping = 0;
+unsigned char commandstart = 0;
+
+/* Multi-byte commands: the command waiting for arguments, how many it
+ * needs and the ones received so far. The RX interrupt also counts them,
+ * so an argument is never taken for a report request. */
+unsigned char argcommand = 0;
+unsigned char argsneeded = 0;
+unsigned char argcount = 0;
+unsigned char args[MAX_COMMAND_ARGS];
+unsigned char rxargs = 0;
+unsigned char rxmacro = 0;
+
+/* What is sent to the host. */
+unsigned char outputmode = OUTPUT_EVENTS;
+
+/* Whether the host's XON and XOFF are honoured, and whether it has sent
+ * XOFF. */
+unsigned char flowcontrol = 0;
+unsigned char txpaused = 0;
+
+/* Raw matrix buffer, the bank values last queued, and banks which must be
+ * sent regardless of whether they have changed. */
+unsigned char rawreadpointer = 0;
+unsigned char rawwritepointer = 0;
+unsigned char rawbuffer[RAW_BUFFER_SIZE];
+unsigned char rawlast[NUM_BANKS];
+unsigned int rawdirty = 0;
+
+/* High priority event buffer, and how many events in the main buffer
+ * can't be overtaken. */
+unsigned char priorityreadpointer = 0;
+unsigned char prioritywritepointer = 0;
+unsigned char prioritybuffer[PRIORITY_BUFFER_SIZE];
+unsigned char keyorder = 0;
+
+/* Bitmaps of scancodes: the keys down as last read, and as last settled. */
+unsigned char keystate[(SCANCODE_LIMIT + 7) / 8];
+unsigned char steadystate[(SCANCODE_LIMIT + 7) / 8];
+
+/* Keys being debounced, NO_KEY for a free slot, and their counters. */
+unsigned char debouncekeys[DEBOUNCE_SLOTS];
+unsigned char debouncecounts[DEBOUNCE_SLOTS];
+
+/* Keys with a wider debounce threshold than steadythresh, NO_KEY for a
+ * free entry, their thresholds, and the longest gap between bounces seen
+ * since the statistics were last sent, in scans. */
+unsigned char widekeys[WIDE_KEYS];
+unsigned char widethresh[WIDE_KEYS];
+unsigned char widegap[WIDE_KEYS];
+
+/* Per key statistics since they were last sent: presses (high nibble) and
+ * how many of them bounced (low nibble). Both are halved when the presses
+ * would pass 15, so they keep their ratio. */
+unsigned char keystats[SCANCODE_LIMIT];
+
+/* Keymap: the scancode sent for each key, in flash. Entries can be
+ * overridden in EEPROM, where NO_KEY means no override. Rows 6 and 7 are
+ * special codes, so keys can only be mapped to rows 0 to 5; codes the matrix
+ * doesn't produce, like 0x58 to 0x5f on the A600, are free for the host to
+ * use. */
+const unsigned char keymap[KEYMAP_SIZE] PROGMEM = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+	0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+	0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27,
+	0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+	0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+	0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+	0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+	0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57,
+	0x58, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+};
+unsigned char EEMEM eekeymap[SCANCODE_LIMIT];
+
+/* Fn key, its mode and the layer, and their copies in RAM. layerkeys marks
+ * the keys which went down with the layer on, so they go up the same way. */
+unsigned char EEMEM eefnkey;
+unsigned char EEMEM eefnmode;
+unsigned char EEMEM eelayer[LAYER_ENTRIES][2];
+unsigned char fnkey = NO_KEY;
+unsigned char fnmode = FN_HOLD;
+unsigned char layeron = 0;
+unsigned char layerkeys[(SCANCODE_LIMIT + 7) / 8];
+
+/* Macros, and the one being played: its slot, where it's got to and its
+ * length. Also the slot being uploaded and the bytes still to come. */
+unsigned char EEMEM eemacros[MACRO_SLOTS][MACRO_LENGTH + 2];
+unsigned char playslot = 0;
+unsigned char playpos = 0;
+unsigned char playlength = 0;
+unsigned char macroslot = NO_KEY;
+unsigned char macropos = 0;
+unsigned char macrodata = 0;
 
-/* Debouncing counters, one per scancode (key) */
-unsigned char steadycounts[128];
+/* Character layout, unshifted and shifted, for the mapped scancodes, in
+ * EEPROM, where NO_KEY means no entry. A default can be built in, behind
+ * it, from a header named by ASCII_LAYOUT at build time, which defines
+ * ASCII_MAP as the initialiser for asciimap. */
+#ifdef ASCII_LAYOUT
+#include ASCII_LAYOUT
+const unsigned char asciimap[KEYMAP_SIZE][2] PROGMEM = ASCII_MAP;
+#endif
+unsigned char EEMEM eeascii[KEYMAP_SIZE][2];
+
+/* Character mode: modifiers held, and the last key down, for repeats. */
+unsigned char asciimods = 0;
+unsigned char asciilast = NO_KEY;
+
+/* Caps lock state, toggled by the caps lock key. */
+unsigned char capslockon = 0;
+
+/* System chords, cached from EEPROM, which are currently held, and which
+ * the host has been sent as held. */
+unsigned char EEMEM eechords[NUM_CHORDS][CHORD_KEYS];
+unsigned char chords[NUM_CHORDS][CHORD_KEYS];
+unsigned char chordsheld = 0;
+unsigned char chordssent = 0;
+
+/* Chord being learnt (plus one; 0 for none) and the keys so far. */
+unsigned char learningchord = 0;
+unsigned char learncount = 0;
+unsigned char learnkeys[CHORD_KEYS];
+
+/* Settle time for each row, in us and in timer ticks. */
+unsigned char settletimes[NUM_ROWS];
+unsigned char settleticks[NUM_ROWS];
+
+/* Debounce threshold that keys start from, the scan rate, the idle
+ * timeout and the scan boost, along with their saved copies. */
+unsigned char EEMEM eesteadythresh;
+unsigned char EEMEM eescanrate;
+unsigned char EEMEM eeidletimeout;
+unsigned char EEMEM eescanboost;
+unsigned char steadythresh = STEADY_THRESH;
+unsigned char scanrate = DEFAULT_SCAN_RATE;
+unsigned char idletimeout = DEFAULT_IDLE_TIMEOUT;
+unsigned char scanboost = DEFAULT_SCAN_BOOST;
+
+/* Timer compare values for the configured and active scan rates. */
+unsigned int scanocr = SCAN_OCR(DEFAULT_SCAN_RATE);
+unsigned int activeocr = SCAN_OCR(DEFAULT_SCAN_RATE);
+
+/* Idle scanning: scans to wait before going idle, scans since the last
+ * change, and whether scanning is at the idle rate. */
+unsigned int idlescans = 0;
+unsigned int quietscans = 0;
+unsigned char scanidle = 0;
+
+/* LED effect: which one, its colours (A in the low nibble, B in the high)
+ * and period, steps since the last change, how many changes there have
+ * been, and the colour showing. */
+unsigned char ledeffect = EFFECT_NONE;
+unsigned char ledcolours = 0;
+unsigned char ledperiod = 0;
+unsigned char ledsteps = 0;
+unsigned char ledphase = 0;
+unsigned char ledcolour = 0;
+
+/* LED brightness: the level of each channel (blue first), saved in EEPROM,
+ * and the level effects scale them to. The Timer0 interrupt shows
+ * bcmplanes[n], the channels with bit n of their level set, for 2^n
+ * times as long as bit 0. */
+unsigned char EEMEM eeledlevels[LED_CHANNELS];
+unsigned char ledlevels[LED_CHANNELS];
+unsigned char ledscale = MAX_LED_LEVEL;
+unsigned char bcmplanes[BCM_BITS];
+unsigned char bcmbit = 0;
 
 /* Typematic speed values. */
 unsigned char typematicdelay = 0;
 unsigned char typematicrate = 0;
+unsigned char typematicmode = TYPEMATIC_DEVICE;
 
 int main(void)
 {
+#ifdef SPI_TRANSPORT
+	/* SPI slave, bytes received under interrupt. Only MISO is driven. */
+	DDRB = 0b01000000;
+	SPCR = (1 << SPE) | (1 << SPIE);
+	SPDR = SPI_IDLE;
+#else
 	/* Configure the serial port UART */
 	UBRRL = BAUD_PRESCALE;
 	UBRRH = (BAUD_PRESCALE >> 8);
 	UCSRC = (1 << URSEL) | (3 << UCSZ0);
 	UCSRB = (1 << RXEN) | (1 << TXEN);   /* Turn on the transmission and reception circuitry. */
+	UCSRB |= (1 << RXCIE); /* Commands are received under interrupt. */
+
+	/* Give the host a chance to pick the baud rate. */
+	startautobaud(AUTOBAUD_POWERUP_MS);
+
+	DDRB = 0b10000000; /* Bit 7 is caps lock _LED output. */
+#endif
 
 	/* DDRA is setup for each scan. */
-	DDRA = 0b00000000; /* Inputs from keyboard: Column Low */
-	DDRB = 0b10000000; /* Inputs from keyboard: Column High, bit 7 is
-	                    * caps lock _LED output. */
-	DDRC = 0b00000000; /* Inputs from keyboard: Column Metas */
-	DDRD = 0b11111100; /* Outputs to keyboard: Rows, and INT */
+	DDRD = 0b00000100; /* Output to the host: INT. Rows are driven by the scan. */
 	DDRE = 0b00000111; /* -----RGB */
 
 	TCCR1B |= (1 << WGM12); // CTC
-	TCCR1B |= ((1 << CS10) | (1 << CS11)); // Set up timer at Fcpu/64
-	OCR1A   = 625; // 200Hz
+	TCCR1B |= (1 << CS11); // Set up timer at Fcpu/8, for a fine sample phase
+	OCR1A   = SCAN_OCR(DEFAULT_SCAN_RATE); // 200Hz, until the config is loaded
 	TIMSK  |= (1 << OCIE1A); // Enable CTC interrupt
 
-	PORTA = 0b11111111; /* Pullups for Column Low */
-	PORTB = 0b01111111; /* Pullups for Column High */
-	PORTC = 0b11111111; /* Pullups for Column Metas */
+	TCCR0 = (1 << CS02); // LED brightness timer at Fcpu/256, free running
+	OCR0 = BCM_TICKS;
+	TIMSK |= (1 << OCIE0);
+
+	/* Columns are inputs, with pullups. Rows are let go, ready to be
+	 * pulled low. */
+#define INIT_BANK(bank, row, port, mask, base) \
+	DDR##port &= (unsigned char) ~(mask); \
+	PORT##port |= (mask);
+#define INIT_ROW(row, port, bits) \
+	DDR##port &= (unsigned char) ~(bits); \
+	PORT##port &= (unsigned char) ~(bits);
+	MATRIX_BANKS(INIT_BANK)
 	PORTD = 0x04; /* High INT. */
+	MATRIX_ROWS(INIT_ROW)
 	
+	calibratesettle();
 	initkeybuffer();
+	loadchords();
+	loadconfig();
+	loadfnkey();
+	loadleds();
 
 	sei();
 
-	int keydowntimer = 0;
-	unsigned char lastevent = 0;
-	int capslockon = 0;
-
+	/* Run the tasks for ever. When none has anything to do, sleep until
+	 * an interrupt; the timer interrupts bring the periodic ones round. */
+	set_sleep_mode(SLEEP_MODE_IDLE);
 	while (1)
 	{
-		/* See if there is a scancode available. */
+		unsigned int now;
+
 		cli();
-		unsigned char pointerdiff = writepointer - readpointer;
+		now = mstime;
 		sei();
 
-		if (pointerdiff)
+		for (unsigned char t = 0; t < NUM_TASKS; t++)
 		{
-			/* If so, put the first one out. */
-			lastevent = keybuffer[readpointer];
-			readpointer = (readpointer + 1) & (BUFFER_SIZE - 1);
+			unsigned char ready = pgm_read_byte(&tasks[t].ready);
+			unsigned char period = pgm_read_byte(&tasks[t].period);
+			unsigned char run;
 
-			if (
-				!(lastevent & 0b10000000) &&
-				((lastevent & 0x70) != 0x50) &&
-				(lastevent != KEY_CAPS_LOCK)
-			) {
-				keydowntimer = typematicdelay;
-			}
-			else
-				keydowntimer = 0;
+			cli();
+			run = readyflags & ready;
+			readyflags &= ~ready;
+			sei();
 
-			/* Caps lock handling. Caps lock up or down? */
-			if ((lastevent & 0b01111111) == KEY_CAPS_LOCK)
-			{
-				/* Down? */
-				if (!(lastevent & 0b10000000))
-				{
-					if (!capslockon)
-					{
-						/* If it was off before, make it on and
-						 * send key down. */
-						writechar(KEY_CAPS_LOCK);
-						PORTB |= 0x80;
-						capslockon = 1;
-					}
-					else
-					{
-						/* If it was on before, make it off
-						 * and send key up. */
-						writechar(KEY_CAPS_LOCK | 0x80);
-						PORTB &= ~0x80;
-						capslockon = 0;
-					}
-				}
-			}
-			else
+			/* A task which has fallen more than a period behind,
+			 * because another took a long time, runs once and
+			 * carries on from now rather than catching up. */
+			if (period && now - tasklast[t] >= period)
 			{
-				/* Otherwise (normal key and not caps lock going
-				 * up), send the key scancode. */
-				writechar(lastevent);
+				if (now - tasklast[t] >= 2 * period)
+					tasklast[t] = now;
+				else
+					tasklast[t] += period;
+				run = 1;
 			}
+
+			if (run)
+				((void (*)(void)) pgm_read_word(&tasks[t].run))();
 		}
 
-		if (keydowntimer > 0)
+		cli();
+		if (!readyflags)
 		{
-			/* Timer running, decrement timer. */
-			keydowntimer--;
-			if (keydowntimer == 0)
-			{
-				/* Until timer is zero, when we send the last
-				 * scancode and reset to the (shorter) repeat
-				 * timer. */
-				writechar(lastevent);
-				keydowntimer = 100;
-			}
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
 		}
+		sei();
+	}
+
+	return 0; /* Not reached. */
+}
+
+/* Send key events, high priority ones first, dealing with the Fn key,
+ * macros, chord learning, the keymap and caps lock on the way. */
+void eventtask(void)
+{
+	/* See if there is a scancode available, high priority ones
+	 * first. While the host has paused sending, events are left in the
+	 * buffers. */
+	unsigned char haveevent = 1;
+
+	cli();
+	if (txpaused)
+		haveevent = 0;
+	else if (priorityreadpointer != prioritywritepointer)
+	{
+		lastevent = prioritybuffer[priorityreadpointer];
+		priorityreadpointer = (priorityreadpointer + 1) &
+			(PRIORITY_BUFFER_SIZE - 1);
+	}
+	else if (readpointer != writepointer)
+	{
+		lastevent = keybuffer[readpointer];
+		readpointer = (readpointer + 1) & (BUFFER_SIZE - 1);
+		if (ORDERED(lastevent))
+			keyorder--;
+	}
+	else
+		haveevent = 0;
+	if (haveevent && (priorityreadpointer != prioritywritepointer ||
+		readpointer != writepointer))
+	{
+		readyflags |= READY_EVENTS;
+	}
+	sei();
+
+	/* The Fn key only switches the layer, and macro triggers
+	 * start their macro; neither is sent. */
+	if (haveevent && (fnkeyevent(lastevent) || macroevent(lastevent)))
+	{
+		haveevent = 0;
+		keydowntimer = 0;
+	}
+
+	if (haveevent)
+	{
+		/* If so, put it out, through the keymap. Chords are
+		 * learnt from the keys themselves. */
+		if (learningchord)
+			learnchord(lastevent);
+		lastevent = remapevent(lastevent);
 
-		/* See if there is a command byte available. */
-		if (UCSRA & (1 << RXC))
+		/* Any batched repeats of the previous key go out before
+		 * the new edge. */
+		if (repeatpending)
 		{
-			/* Grab it. */
-			unsigned char incommand = UDR;
+			sendevent(REPEAT_CODE | repeatpending);
+			repeatpending = 0;
+		}
 
-			/* Split the command. */
-			unsigned char commandtype = incommand & COM_TYPE_MASK;
-			unsigned char commandvalue = incommand & COM_VALUE_MASK;
+		if (
+			typematicmode != TYPEMATIC_HOST &&
+			!(lastevent & 0b10000000) &&
+			!ISMETA(lastevent) &&
+			!ISCHORD(lastevent) &&
+			(lastevent != KEY_CAPS_LOCK)
+		) {
+			keydowntimer = typematicdelay / TYPEMATIC_MS;
+		}
+		else
+			keydowntimer = 0;
 
-			switch (commandtype)
+		/* Caps lock handling. Caps lock up or down? */
+		if ((lastevent & 0b01111111) == KEY_CAPS_LOCK)
+		{
+			/* Down? */
+			if (!(lastevent & 0b10000000))
 			{
-				case COM_TYPE_REGULAR:
-					switch (commandvalue)
-					{
-						case COM_RED_LED_OFF:
-							PORTE &= ~0x04;
-							break;
-						case COM_RED_LED_ON:
-							PORTE |= 0x04;
-							break;
-						case COM_GREEN_LED_OFF:
-							PORTE &= ~0x02;
-							break;
-						case COM_GREEN_LED_ON:
-							PORTE |= 0x02;
-							break;
-						case COM_BLUE_LED_OFF:
-							PORTE &= ~0x01;
-							break;
-						case COM_BLUE_LED_ON:
-							PORTE |= 0x01;
-							break;
-						case COM_INIT:
-							initkeybuffer();
-							capslockon = 0;
-							break;
-						default:
-							break;
-					}
-					break;
-				/* Other commands have the value in the low
-				 * six bits. */
-				case COM_TYPE_DELAY:
-					typematicdelay = commandvalue << 2;
-					break;
-				case COM_TYPE_RATE:
-					typematicrate = commandvalue << 2;
-					break;
-				default:
-					break;
+				if (!capslockon)
+				{
+					/* If it was off before, make it on and
+					 * send key down. */
+					sendevent(KEY_CAPS_LOCK);
+					CAPS_LED_ON();
+					capslockon = 1;
+				}
+				else
+				{
+					/* If it was on before, make it off
+					 * and send key up. */
+					sendevent(KEY_CAPS_LOCK | 0x80);
+					CAPS_LED_OFF();
+					capslockon = 0;
+				}
 			}
 		}
-
-		_delay_ms(1);
+		else
+		{
+			/* Otherwise (normal key and not caps lock going
+			 * up), send the key scancode. */
+			sendevent(lastevent);
+		}
 	}
-
-	return 0; /* Not reached. */
 }
 
-void writechar(char c)
+/* Count down to the next key repeat, and send it. */
+void typematictask(void)
 {
-	while(!(UCSRA & (1<<UDRE)));
+	/* The mode can also be changed through its register, so check
+	 * it here too. */
+	if (keydowntimer > 0 && typematicmode == TYPEMATIC_HOST)
+		keydowntimer = 0;
+
+	if (keydowntimer > 0)
+	{
+		/* Timer running, decrement timer. */
+		keydowntimer--;
+		if (keydowntimer == 0)
+		{
+			/* Until timer is zero, when we send the last
+			 * scancode and reset to the (shorter) repeat
+			 * timer. Repeats must never queue up in front of
+			 * real events, so if there are events waiting or
+			 * the UART is still busy this repeat is dropped,
+			 * or merged into the batched count. */
+			unsigned char busy = eventbacklog() ||
+				txreadpointer != txwritepointer || txpaused;
 
-	UDR = c;
+			if (typematicmode == TYPEMATIC_BATCHED)
+			{
+				/* Only send a count every few repeats. */
+				if (repeatpending < REPEAT_COUNT_MAX)
+					repeatpending++;
+				if (repeatpending >= REPEAT_BATCH_SIZE && !busy)
+				{
+					sendevent(REPEAT_CODE | repeatpending);
+					repeatpending = 0;
+				}
+			}
+			else if (!busy)
+				sendevent(lastevent);
+			keydowntimer = typematicrate / TYPEMATIC_MS;
+		}
+	}
 }
 
-void writestring(char *string)
+/* Send raw matrix data and macros. */
+void outputtask(void)
 {
-	char *p = string;
-	
-	while (*p)
+	/* Send whatever raw matrix data has been queued. */
+	while (rawreadpointer != rawwritepointer && !txpaused)
 	{
-		writechar(*p);
-		p++;
+		startframe();
+		writechar(rawbuffer[rawreadpointer]);
+		writechar(rawbuffer[rawreadpointer + 1]);
+		endframe();
+		rawreadpointer = (rawreadpointer + 2) &
+			(RAW_BUFFER_SIZE - 1);
+	}
+
+	/* Send some more of the macro, if one is playing. */
+	if (playlength && !txpaused)
+	{
+		playmacro();
+		if (playlength)
+			setready(READY_OUTPUT);
 	}
 }
 
-char readchar(void)
+/* Flag that a task has work, from anywhere. */
+static inline void setready(unsigned char flags)
 {
-	char x;
-
-	/* Will block until there is a char, no interrupts here. */
-	while(!(UCSRA & (1 << RXC)));
-
-	x = UDR;
+	unsigned char sreg = SREG;
 
-	return x;
+	cli();
+	readyflags |= flags;
+	SREG = sreg;
 }
 
-void initkeybuffer(void)
+/* Take a byte from the host and act on it. */
+void commandtask(void)
 {
-	memset(keystate, 0, 16);
-
-	readpointer = 0;
-	writepointer = 0;
-
-	memset(steadycounts, 0, 128);
-
-	typematicdelay = DEFAULT_TYPEMATIC_DELAY;
-	typematicrate = DEFAULT_TYPEMATIC_RATE;
+	/* If a command was dropped, tell the host when its place is reached,
+	 * after the commands before it and before those after it. */
+	unsigned char cut;
 
-	/* Turn the RGB and caps lock LEDs off. */
-	PORTE = 0x00;
-	PORTB &= ~0x80;
-}
+	cli();
+	cut = commandoverflow && commandreadpointer == commandcut;
+	if (cut)
+		commandoverflow = 0;
+	sei();
 
-/* The thing that makes it all work: timer interrupt. */
-ISR(TIMER1_COMPA_vect)
-{
-	unsigned char outstrobe = 0b00001000;
+	if (cut)
+	{
+		/* Any part of it already taken is abandoned, and a macro
+		 * only partly uploaded is turned off. */
+		if (macrodata && macroslot != NO_KEY)
+			eeprom_update_byte(&eemacros[macroslot][0], NO_KEY);
+		macrodata = 0;
+		argsneeded = 0;
+		writechar(OVERFLOW_CODE);
+		if (commandreadpointer != commandwritepointer)
+			setready(READY_COMMANDS);
+		return;
+	}
 
-	for (int row = 0; row < 6; row++)
+	/* See if there is a command byte available. It may be macro
+	 * data, or an argument for the last command. */
+	if (commandreadpointer != commandwritepointer && macrodata)
 	{
-		/* Set the A-G we are scanning on as output. */
-		if (row < 5)
-			DDRD = outstrobe | 0b0000100;
-		else
-			DDRD = 0b00000100;
+		unsigned char data = readcommand();
 
-		_delay_us(10);
-		
-		for (int bank = 0; bank < (row < 5 ? 2 : 1); bank++)
+		if (macroslot != NO_KEY && macropos < MACRO_LENGTH)
+			eeprom_update_byte(&eemacros[macroslot][macropos++ + 2],
+				data);
+		macrodata--;
+		writechar(ACK_CODE);
+	}
+	else if (commandreadpointer != commandwritepointer && argsneeded)
+	{
+		args[argcount++] = readcommand();
+		if (argcount == argsneeded)
 		{
-			unsigned char in;
-			unsigned char instrobe = 1;
+			argsneeded = 0;
+			runcommandargs();
+		}
+	}
+	else if (commandreadpointer != commandwritepointer)
+	{
+		/* Grab it. */
+		unsigned char incommand = readcommand();
 
-			if (row < 5)
-			{
-				if (bank == 0)
+		/* Split the command. */
+		unsigned char commandtype = incommand & COM_TYPE_MASK;
+		unsigned char commandvalue = incommand & COM_VALUE_MASK;
+
+		switch (commandtype)
+		{
+			case COM_TYPE_REGULAR:
+				switch (commandvalue)
 				{
-					in = PINA;
+					case COM_RED_LED_OFF:
+						setleds(ledcolour & ~0x04);
+						break;
+					case COM_RED_LED_ON:
+						setleds(ledcolour | 0x04);
+						break;
+					case COM_GREEN_LED_OFF:
+						setleds(ledcolour & ~0x02);
+						break;
+					case COM_GREEN_LED_ON:
+						setleds(ledcolour | 0x02);
+						break;
+					case COM_BLUE_LED_OFF:
+						setleds(ledcolour & ~0x01);
+						break;
+					case COM_BLUE_LED_ON:
+						setleds(ledcolour | 0x01);
+						break;
+					case COM_INIT:
+						initkeybuffer();
+						capslockon = 0;
+						repeatpending = 0;
+						keydowntimer = 0;
+						outputmode = OUTPUT_EVENTS;
+						cli();
+						txpaused = 0;
+						TX_START();
+						sei();
+						setready(READY_EVENTS | READY_OUTPUT);
+						break;
+					case COM_TYPEMATIC_DEVICE:
+						typematicmode = TYPEMATIC_DEVICE;
+						break;
+					case COM_TYPEMATIC_HOST:
+						typematicmode = TYPEMATIC_HOST;
+						keydowntimer = 0;
+						break;
+					case COM_TYPEMATIC_BATCHED:
+						typematicmode = TYPEMATIC_BATCHED;
+						break;
+					case COM_LEARN_CHORD_0:
+					case COM_LEARN_CHORD_1:
+						learningchord = commandvalue -
+							COM_LEARN_CHORD_0 + 1;
+						learncount = 0;
+						break;
+					case COM_REPORT_MODE:
+						outputmode = OUTPUT_REPORTS;
+						repeatpending = 0;
+						keydowntimer = 0;
+						break;
+					case COM_EVENT_MODE:
+						outputmode = OUTPUT_EVENTS;
+						break;
+					case COM_RAW_MODE:
+						/* Start with every bank. */
+						cli();
+						rawreadpointer = rawwritepointer;
+						rawdirty = (unsigned int) ((1UL << NUM_BANKS) - 1);
+						outputmode = OUTPUT_RAW;
+						sei();
+						repeatpending = 0;
+						keydowntimer = 0;
+						break;
+					case COM_STATS:
+						sendstats();
+						break;
+					case COM_CLEAR_STATS:
+						cli();
+						memset(keystats, 0, SCANCODE_LIMIT);
+						memset(widegap, 0, WIDE_KEYS);
+						sei();
+						break;
+					case COM_CONFIG:
+						sendconfig();
+						break;
+					case COM_CALIBRATE:
+						calibratesettle();
+						sendcalibration();
+						break;
+					case COM_SET_REMAP:
+						argcommand = commandvalue;
+						argsneeded = COMMAND_ARGS(commandvalue);
+						argcount = 0;
+						break;
+					case COM_CLEAR_REMAP:
+						for (unsigned char scancode = 0;
+							scancode < SCANCODE_LIMIT; scancode++)
+						{
+							eeprom_update_byte(&eekeymap[scancode],
+								NO_KEY);
+						}
+						writechar(ACK_CODE);
+						break;
+					case COM_ASCII_MODE:
+						outputmode = OUTPUT_ASCII;
+						asciimods = 0;
+						asciilast = NO_KEY;
+						break;
+					case COM_SET_ASCII:
+						argcommand = commandvalue;
+						argsneeded = COMMAND_ARGS(commandvalue);
+						argcount = 0;
+						break;
+					case COM_SET_FN_KEY:
+					case COM_SET_LAYER:
+					case COM_SET_MACRO:
+					case COM_REGISTERS:
+					case COM_LED_EFFECT:
+					case COM_LED_BRIGHTNESS:
+						argcommand = commandvalue;
+						argsneeded = COMMAND_ARGS(commandvalue);
+						argcount = 0;
+						break;
+					case COM_CLEAR_LAYER:
+						for (int e = 0; e < LAYER_ENTRIES; e++)
+							eeprom_update_byte(&eelayer[e][0], NO_KEY);
+						writechar(ACK_CODE);
+						break;
+					case COM_CLEAR_CHORDS:
+						memset(learnkeys, NO_KEY, CHORD_KEYS);
+						for (int c = 0; c < NUM_CHORDS; c++)
+							eeprom_update_block(learnkeys,
+								eechords[c], CHORD_KEYS);
+						loadchords();
+						writechar(ACK_CODE);
+						break;
+					default:
+						if (commandvalue >= COM_RGB_LED &&
+							commandvalue <= COM_RGB_LED_LAST)
+						{
+							setleds(commandvalue);
+						}
+						break;
 				}
-				else
+				break;
+			/* Other commands have the value in the low
+			 * six bits. */
+			case COM_TYPE_DELAY:
+				typematicdelay = commandvalue << 2;
+				break;
+			case COM_TYPE_RATE:
+				typematicrate = commandvalue << 2;
+				break;
+			case COM_TYPE_CONFIG:
+				/* Set, save and report back what was
+				 * actually used. */
+				if (commandvalue & COM_CONFIG_RATE)
 				{
-					in = PINB;
+					setscanrate(commandvalue & COM_CONFIG_VALUE_MASK);
+					eeprom_update_byte(&eescanrate, scanrate);
 				}
-			}
-			else
-			{
-				in = PINC;
-			}
-
-			for (int col = 0; col < (bank < 1 ? 8 : 7); col++)
-			{
-				unsigned char scancode = GETSCAN(row, bank, col);
-
-				if (!(in & instrobe))
+				else if (commandvalue & COM_CONFIG_IDLE)
 				{
-					/* Key down */
-					if (!(keystate[scancode >> 3] & instrobe))
-					{
-						/* Start the debouncing counter */
-						steadycounts[scancode] = 1;	
-						keystate[scancode >> 3] |= instrobe;
-					}
+					setidletimeout(commandvalue & COM_CONFIG_SMALL_VALUE_MASK);
+					eeprom_update_byte(&eeidletimeout, idletimeout);
 				}
 				else
 				{
-					/* Key up */
-					if ((keystate[scancode >> 3] & instrobe))
-					{
-						/* Start the debouncing counter */
-						steadycounts[scancode] = 1;
-						keystate[scancode >> 3] &= ~instrobe;
-					}
+					setsteadythresh(commandvalue & COM_CONFIG_SMALL_VALUE_MASK);
+					eeprom_update_byte(&eesteadythresh, steadythresh);
 				}
+				sendconfig();
+				break;
+			default:
+				break;
+		}
+	}
 
-				if (steadycounts[scancode] > STEADY_THRESH)
-				{
-					/* Key is "stuck" up, or down? Generate an event. */
-					if (!(keystate[scancode >> 3] & instrobe))
-					{
-						keybuffer[writepointer] = scancode | 0b10000000;
-					}
-					if ((keystate[scancode >> 3] & instrobe))
-					{
-						keybuffer[writepointer] = scancode;
-					}
+	/* Come back for the rest, or to report a dropped command. */
+	if (commandreadpointer != commandwritepointer || commandoverflow)
+		setready(READY_COMMANDS);
+}
 
-					/* Advance the writepointer, and stop the debounce
-					 * counter. */
-					writepointer = (writepointer + 1) & (BUFFER_SIZE - 1);
-					steadycounts[scancode] = 0;					
-				}
-				else if (steadycounts[scancode] > 0)
-				{
-					/* Counter is running, so count! */
-					steadycounts[scancode]++;
-				}
+/* Step the LED effect. */
+void ledtask(void)
+{
+	if (ledeffect != EFFECT_NONE)
+		stepeffect();
+}
 
-				instrobe <<= 1;
-			}
-		}
-		outstrobe <<= 1;
+/* Start looking for the host's sync byte, for the given time. The receiver
+ * is turned off meanwhile. Called at power up and from the RX interrupt. */
+void startautobaud(unsigned int ms)
+{
+	UCSRB &= ~(1 << RXEN);
+	autobaudstate = AUTOBAUD_TIMING;
+	autobaudend = mstime + ms;
+	readyflags |= READY_AUTOBAUD;
+}
+
+/* Keep trying to time the sync byte until it locks or time runs out, then
+ * give the host a moment to stop sending it before listening again. The
+ * host is told the rate has locked with ACK_CODE, at the new rate. */
+void autobaudtask(void)
+{
+	unsigned int now;
+
+	cli();
+	now = mstime;
+	sei();
+
+	/* Out of time, or settled: listen again. */
+	if ((int) (now - autobaudend) >= 0)
+	{
+		cli();
+		autobaudstate = AUTOBAUD_OFF;
+		UCSRB |= (1 << RXEN);
+		sei();
+		return;
+	}
+
+	if (autobaudstate == AUTOBAUD_TIMING && autobaud())
+	{
+		autobaudstate = AUTOBAUD_SETTLING;
+		autobaudend = now + AUTOBAUD_SETTLE_MS;
+		writechar(ACK_CODE);
+	}
+
+	setready(READY_AUTOBAUD);
+}
+
+/* Try to time the host's sync byte and switch the UART to its rate.
+ * Interrupts are off while it waits, so the edges are timed exactly, but
+ * only until the next scan is due, or the ms clock is about to miss a
+ * Timer0 wrap; a sync byte cut off is let go, and the host sends another.
+ * Returns 1 if the rate was changed. */
+unsigned char autobaud(void)
+{
+	unsigned int edges[AUTOBAUD_EDGES];
+	unsigned char locked = 0;
+
+	cli();
+
+#define AUTOBAUD_WAIT(cond) \
+	while (cond) \
+	{ \
+		if ((TIFR & (1 << OCF1A)) || \
+			(unsigned char) (TCNT0 - clocklast) >= 192) \
+			goto done; \
+	}
+
+	/* From an idle line, time the falling edge at the start of every
+	 * other bit. Timer1 is cleared at the end of each scan period, which
+	 * is never reached here, so the times don't wrap. */
+	AUTOBAUD_WAIT(!(PIND & 0x01))
+	for (unsigned char e = 0; e < AUTOBAUD_EDGES; e++)
+	{
+		AUTOBAUD_WAIT(PIND & 0x01)
+		edges[e] = TCNT1;
+		AUTOBAUD_WAIT(!(PIND & 0x01))
+	}
+	if (TIFR & (1 << OCF1A))
+		goto done;
+
+	/* The edges are two bits apart, so the byte took sixteen times the
+	 * prescale the UART needs (plus one). They must all be nearly even,
+	 * and the rate within 2% of one the UART can do. */
+	unsigned int total = edges[AUTOBAUD_EDGES - 1] - edges[0];
+	unsigned int prescale = (total + 8) / 16;
+	unsigned int error = total > prescale * 16 ?
+		total - prescale * 16 : prescale * 16 - total;
+
+	for (unsigned char e = 1; e < AUTOBAUD_EDGES; e++)
+	{
+		unsigned int gap = edges[e] - edges[e - 1];
+		unsigned int even = total / (AUTOBAUD_EDGES - 1);
+
+		if ((gap > even ? gap - even : even - gap) > even / 8)
+			goto done;
+	}
+	if (prescale < 1 || prescale > 4096 || error > total / 50)
+		goto done;
+
+	UBRRH = (prescale - 1) >> 8;
+	UBRRL = prescale - 1;
+	locked = 1;
+
+done:
+	sei();
+
+	return locked;
+}
+
+/* Queue a byte for the UART, waiting for room if the buffer is full (and
+ * so, while the host has paused sending, for its XON). Only called from the
+ * main program. */
+void writechar(char c)
+{
+	while (1)
+	{
+		cli();
+		if (((txwritepointer + 1) & (TX_BUFFER_SIZE - 1)) != txreadpointer)
+			break;
+		sei();
+	}
+
+	txbuffer[txwritepointer] = c;
+	if (txframe)
+		txends &= ~(1U << txwritepointer);
+	else
+		txends |= (1U << txwritepointer);
+	txwritepointer = (txwritepointer + 1) & (TX_BUFFER_SIZE - 1);
+	TX_START();
+	sei();
+}
+
+/* Bracket the bytes of a frame, so a report isn't sent in the middle of
+ * it. A byte written outside one is a frame by itself. */
+void startframe(void)
+{
+	txframe++;
+}
+
+void endframe(void)
+{
+	if (--txframe)
+		return;
+
+	/* Mark the last byte as the end, or if it has already gone, say so
+	 * now. Either way a waiting report can go after it. */
+	cli();
+	if (txreadpointer == txwritepointer)
+		txboundary = 1;
+	else
+		txends |= (1U << ((txwritepointer - 1) & (TX_BUFFER_SIZE - 1)));
+	TX_START();
+	sei();
+}
+
+/* Take the next byte to send. A waiting report goes first, but only
+ * between frames; otherwise the next byte in the buffer, unless the host
+ * has paused sending. Returns 0 if there is nothing to send. */
+static inline unsigned char nexttxbyte(unsigned char *c)
+{
+	if (reportpos < REPORT_LENGTH && txboundary)
+		*c = report[reportpos++];
+	else if (txreadpointer != txwritepointer && !txpaused)
+	{
+		*c = txbuffer[txreadpointer];
+		txboundary = (txends >> txreadpointer) & 1;
+		txreadpointer = (txreadpointer + 1) & (TX_BUFFER_SIZE - 1);
+	}
+	else
+		return 0;
+
+	return 1;
+}
+
+#ifndef SPI_TRANSPORT
+/* The UART can take another byte. When there is nothing to send the
+ * interrupt turns itself off until there is. */
+ISR(USART_UDRE_vect)
+{
+	unsigned char c;
+
+	if (nexttxbyte(&c))
+		UDR = c;
+	else
+		UCSRB &= ~(1 << UDRIE);
+}
+#endif
+
+/* Send a key event, or the characters for it, unless the host wants
+ * something else. */
+void sendevent(unsigned char event)
+{
+	if (outputmode == OUTPUT_EVENTS)
+		writechar(event);
+	else if (outputmode == OUTPUT_ASCII)
+	{
+		/* Batched repeats are sent as the characters. */
+		if ((event & 0b11110000) == REPEAT_CODE)
+		{
+			for (unsigned char c = event & 0x0f; c; c--)
+				sendascii(asciilast);
+		}
+		else
+			sendascii(event);
+	}
+}
+
+/* Translate a key event to characters using the layout, the modifiers
+ * held and caps lock. Alt sends an ESC first, control makes a control
+ * character. */
+void sendascii(unsigned char event)
+{
+	unsigned char scancode = event & 0b01111111;
+	unsigned char c;
+
+	if (scancode >= KEYMAP_SIZE)
+		return;
+
+	c = asciilookup(scancode, 0);
+
+	if (c >= ASCII_SHIFT && c <= ASCII_ALT)
+	{
+		if (event & 0b10000000)
+			asciimods &= ~(1 << (c - ASCII_SHIFT));
+		else
+			asciimods |= (1 << (c - ASCII_SHIFT));
+		return;
+	}
+
+	if (event & 0b10000000)
+		return;
+
+	if (asciimods & MOD_SHIFT)
+		c = asciilookup(scancode, 1);
+	if (c == 0x00 || c == NO_KEY)
+		return;
+
+	asciilast = event;
+
+	startframe();
+	if (asciimods & MOD_ALT)
+		writechar(ASCII_ESCAPE);
+
+	if (c & ASCII_CSI)
+	{
+		writechar(ASCII_ESCAPE);
+		writechar('[');
+		writechar(c & 0b01111111);
+	}
+	else
+	{
+		if (capslockon && c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		if (asciimods & MOD_CTRL)
+			c &= 0x1f;
+
+		writechar(c);
+	}
+	endframe();
+}
+
+/* Find a character layout entry: from EEPROM, or if there is none there,
+ * the built in layout, if there is one. */
+unsigned char asciilookup(unsigned char scancode, unsigned char shifted)
+{
+	unsigned char c = eeprom_read_byte(&eeascii[scancode][shifted]);
+
+#ifdef ASCII_LAYOUT
+	if (c == NO_KEY)
+		c = pgm_read_byte(&asciimap[scancode][shifted]);
+#endif
+
+	return c;
+}
+
+/* Dump the per key statistics, clearing them as they go, so each dump
+ * covers the time since the last. */
+void sendstats(void)
+{
+	startframe();
+	writechar(STATS_CODE);
+	for (unsigned char scancode = 0; scancode < SCANCODE_LIMIT; scancode++)
+	{
+		cli();
+		unsigned char stats = keystats[scancode];
+		keystats[scancode] = 0;
+		sei();
+
+		writechar(stats);
+	}
+
+	/* Then the keys with a threshold of their own, and their longest
+	 * gaps. */
+	for (unsigned char w = 0; w < WIDE_KEYS; w++)
+	{
+		cli();
+		unsigned char scancode = widekeys[w];
+		unsigned char thresh = widethresh[w];
+		unsigned char gap = widegap[w];
+		widegap[w] = 0;
+		sei();
+
+		writechar(scancode);
+		writechar(scancode == NO_KEY ? NO_KEY : thresh);
+		writechar(scancode == NO_KEY ? NO_KEY : gap);
+	}
+	endframe();
+}
+
+/* Take a polled report of the keys currently held, and start it going.
+ * Called from the RX interrupt, or from the scan if another was asked for
+ * while the last was being sent. */
+void makereport(void)
+{
+	unsigned char metas = 0;
+	unsigned char count = 0;
+
+	memset(report + 2, NO_KEY, REPORT_KEYS);
+
+	for (unsigned char scancode = 0; scancode < SCANCODE_LIMIT; scancode++)
+	{
+		if (!KEYDOWN(scancode))
+			continue;
+
+		if (ISMETA(scancode))
+			metas |= (1 << (scancode & 0x07));
+		else if (count < REPORT_KEYS)
+			report[2 + count++] = scancode;
+		else
+			memset(report + 2, REPORT_ROLLOVER, REPORT_KEYS);
+	}
+
+	report[0] = REPORT_CODE;
+	report[1] = metas;
+	reportpos = 0;
+	TX_START();
+}
+
+void writestring(char *string)
+{
+	char *p = string;
+	
+	while (*p)
+	{
+		writechar(*p);
+		p++;
+	}
+}
+
+char readchar(void)
+{
+	char x;
+
+	/* Will block until there is a char, no interrupts here. */
+	while(!(UCSRA & (1 << RXC)));
+
+	x = UDR;
+
+	return x;
+}
+
+/* Reset the key state, buffers and modes. The scan uses most of these, so
+ * it is kept out until they all agree again. */
+void initkeybuffer(void)
+{
+	unsigned char sreg = SREG;
+
+	cli();
+	memset(keystate, 0, sizeof(keystate));
+	memset(steadystate, 0, sizeof(steadystate));
+
+	readpointer = 0;
+	writepointer = 0;
+	priorityreadpointer = 0;
+	prioritywritepointer = 0;
+	keyorder = 0;
+	rawreadpointer = 0;
+	rawwritepointer = 0;
+
+	memset(debouncekeys, NO_KEY, DEBOUNCE_SLOTS);
+
+	typematicdelay = DEFAULT_TYPEMATIC_DELAY;
+	typematicrate = DEFAULT_TYPEMATIC_RATE;
+	typematicmode = TYPEMATIC_DEVICE;
+
+	/* Turn the RGB and caps lock LEDs off. */
+	setleds(0);
+	CAPS_LED_OFF();
+
+	/* Stop any macro. */
+	playlength = 0;
+
+	/* Turn the Fn layer off. */
+	layeron = 0;
+	memset(layerkeys, 0, sizeof(layerkeys));
+
+	/* Drop any held chord and release the signal line. */
+	chordsheld = 0;
+	chordssent = 0;
+	learningchord = 0;
+	PORTD |= SIGNAL_BIT;
+	SREG = sreg;
+}
+
+/* Copy the system chords out of EEPROM, so the timer interrupt can get at
+ * them quickly. */
+void loadchords(void)
+{
+	cli();
+	eeprom_read_block(chords, eechords, sizeof(chords));
+	sei();
+}
+
+/* Get the debounce threshold and scan rate from EEPROM, or use the
+ * defaults if it is blank. */
+void loadconfig(void)
+{
+	unsigned char thresh = eeprom_read_byte(&eesteadythresh);
+	unsigned char rate = eeprom_read_byte(&eescanrate);
+	unsigned char timeout = eeprom_read_byte(&eeidletimeout);
+	unsigned char boost = eeprom_read_byte(&eescanboost);
+
+	setsteadythresh(thresh == 0xff ? STEADY_THRESH : thresh);
+	setscanrate(rate == 0xff ? DEFAULT_SCAN_RATE : rate);
+	setidletimeout(timeout == 0xff ? DEFAULT_IDLE_TIMEOUT : timeout);
+	setscanboost(boost == 0xff ? DEFAULT_SCAN_BOOST : boost);
+}
+
+/* Set the threshold every key starts from, resetting any adaptation. */
+void setsteadythresh(unsigned char thresh)
+{
+	if (thresh < MIN_STEADY_THRESH)
+		thresh = MIN_STEADY_THRESH;
+	if (thresh > MAX_STEADY_THRESH)
+		thresh = MAX_STEADY_THRESH;
+
+	steadythresh = thresh;
+
+	cli();
+	memset(widekeys, NO_KEY, WIDE_KEYS);
+	sei();
+}
+
+/* Set the scan rate, reprogramming the timer. The scan boost is kept
+ * within what the new rate allows. */
+void setscanrate(unsigned char rate)
+{
+	if (rate < MIN_SCAN_RATE)
+		rate = MIN_SCAN_RATE;
+	if (rate > MAX_SCAN_RATE)
+		rate = MAX_SCAN_RATE;
+
+	/* Restart the count, in case it is already past the new compare
+	 * value, and leave idle scanning until the keyboard is quiet again. */
+	cli();
+	scanrate = rate;
+	idlescans = (unsigned int) idletimeout * rate * SCAN_RATE_UNIT / 10;
+	quietscans = 0;
+	scanidle = 0;
+	scanocr = SCAN_OCR(rate);
+	OCR1A = scanocr;
+	TCNT1 = 0;
+	sei();
+
+	setscanboost(scanboost);
+}
+
+/* Set how much faster to scan while keys are changing, as a shift of the
+ * scan rate. */
+void setscanboost(unsigned char boost)
+{
+	if (boost > MAX_SCAN_BOOST)
+		boost = MAX_SCAN_BOOST;
+	while ((scanrate << boost) > MAX_SCAN_RATE)
+		boost--;
+
+	/* Any key being debounced has its count in the old units, so it
+	 * starts again. */
+	cli();
+	scanboost = boost;
+	activeocr = SCAN_OCR(scanrate << boost);
+	for (unsigned char slot = 0; slot < DEBOUNCE_SLOTS; slot++)
+	{
+		if (debouncekeys[slot] != NO_KEY)
+			debouncecounts[slot] = (debouncecounts[slot] &
+				STEADY_BOUNCED) | 1;
+	}
+	sei();
+}
+
+/* Set how long the keyboard must be quiet before scanning slows down. */
+void setidletimeout(unsigned char timeout)
+{
+	if (timeout > MAX_IDLE_TIMEOUT)
+		timeout = MAX_IDLE_TIMEOUT;
+
+	idletimeout = timeout;
+	setscanrate(scanrate);
+}
+
+/* Report the debounce threshold and scan rate in use. */
+void sendconfig(void)
+{
+	startframe();
+	writechar(CONFIG_CODE);
+	writechar(steadythresh);
+	writechar(scanrate);
+	writechar(idletimeout);
+	endframe();
+}
+
+/* Time, in us, how long the masked column inputs take to be pulled up
+ * after being driven low. Returns 0xff if they never make it. */
+unsigned char measurerise(volatile uint8_t *ddr, volatile uint8_t *port,
+	volatile uint8_t *pin, unsigned char mask)
+{
+	unsigned char us = 0;
+
+	/* Discharge the lines. */
+	*port &= ~mask;
+	*ddr |= mask;
+	_delay_us(DISCHARGE_US);
+
+	/* Back to inputs, then turn the pullups on, so they are never
+	 * driven high. */
+	*ddr &= ~mask;
+	*port |= mask;
+
+	while ((*pin & mask) != mask)
+	{
+		if (++us > MAX_SETTLE_US)
+			return 0xff;
+		_delay_us(1);
+	}
+
+	return us;
+}
+
+/* Work out the settle time for each row. What limits it is how quickly the
+ * columns come back up, through the pullups, after the previous row lets
+ * go, so each bank is timed and a row gets the slowest of its banks.
+ * Runs with interrupts off, so the scan isn't disturbed. */
+void calibratesettle(void)
+{
+	unsigned char sreg = SREG;
+	unsigned char rises[NUM_ROWS];
+	unsigned char rise;
+
+	memset(rises, 0, NUM_ROWS);
+
+	cli();
+#define MEASURE_BANK(bank, row, port, mask, base) \
+	rise = measurerise(&DDR##port, &PORT##port, &PIN##port, mask); \
+	if (rise > rises[row]) \
+		rises[row] = rise;
+	MATRIX_BANKS(MEASURE_BANK)
+	SREG = sreg;
+
+	for (int row = 0; row < NUM_ROWS; row++)
+	{
+		unsigned char settle;
+
+		rise = rises[row];
+		if (rise == 0xff)
+			settle = DEFAULT_SETTLE_US;
+		else if (rise * 2 + 1 > MAX_SETTLE_US)
+			settle = MAX_SETTLE_US;
+		else
+			settle = rise * 2 + 1;
+		if (settle < MIN_SETTLE_US)
+			settle = MIN_SETTLE_US;
+
+		settletimes[row] = settle;
+		settleticks[row] = SETTLE_TICKS(settle);
+	}
+}
+
+/* Report the settle times in use. */
+void sendcalibration(void)
+{
+	startframe();
+	writechar(CALIBRATION_CODE);
+	for (int row = 0; row < NUM_ROWS; row++)
+		writechar(settletimes[row]);
+	endframe();
+}
+
+/* Take the next byte from the command buffer. */
+unsigned char readcommand(void)
+{
+	unsigned char incommand = commandbuffer[commandreadpointer];
+
+	commandreadpointer = (commandreadpointer + 1) &
+		(COMMAND_BUFFER_SIZE - 1);
+
+	return incommand;
+}
+
+/* Run a command once all its argument bytes have arrived. */
+void runcommandargs(void)
+{
+	switch (argcommand)
+	{
+		case COM_SET_REMAP:
+			/* Scancode, then what to send for it; NO_KEY to go
+			 * back to the flash keymap. */
+			if (args[0] < SCANCODE_LIMIT &&
+				(args[1] < KEYMAP_SIZE || args[1] == NO_KEY))
+			{
+				eeprom_update_byte(&eekeymap[args[0]], args[1]);
+			}
+			writechar(ACK_CODE);
+			break;
+		case COM_SET_ASCII:
+			/* Scancode, then its unshifted and shifted
+			 * entries. */
+			if (args[0] < KEYMAP_SIZE)
+			{
+				eeprom_update_byte(&eeascii[args[0]][0], args[1]);
+				eeprom_update_byte(&eeascii[args[0]][1], args[2]);
+			}
+			writechar(ACK_CODE);
+			break;
+		case COM_SET_FN_KEY:
+			/* Scancode, or NO_KEY for none, then the mode. */
+			eeprom_update_byte(&eefnkey, args[0]);
+			eeprom_update_byte(&eefnmode, args[1]);
+			loadfnkey();
+			writechar(ACK_CODE);
+			break;
+		case COM_SET_LAYER:
+			/* Scancode, then what to send for it in the layer;
+			 * NO_KEY removes it. Replaces the key's entry if it
+			 * has one, otherwise takes a free one. */
+			if (args[0] < SCANCODE_LIMIT &&
+				(args[1] < KEYMAP_SIZE || args[1] == NO_KEY))
+			{
+				int spare = -1;
+
+				for (int e = 0; e < LAYER_ENTRIES; e++)
+				{
+					unsigned char key = eeprom_read_byte(&eelayer[e][0]);
+
+					if (key == args[0])
+					{
+						spare = e;
+						break;
+					}
+					if (key == NO_KEY && spare < 0)
+						spare = e;
+				}
+				if (spare >= 0)
+				{
+					eeprom_update_byte(&eelayer[spare][0],
+						args[1] == NO_KEY ? NO_KEY : args[0]);
+					eeprom_update_byte(&eelayer[spare][1], args[1]);
+				}
+			}
+			writechar(ACK_CODE);
+			break;
+		case COM_SET_MACRO:
+			/* Slot, trigger and length, then the bytes. Anything
+			 * past MACRO_LENGTH is dropped. */
+			macroslot = (args[0] < MACRO_SLOTS ? args[0] : NO_KEY);
+			macropos = 0;
+			macrodata = args[2];
+			if (macroslot != NO_KEY)
+			{
+				if (playlength && playslot == macroslot)
+					playlength = 0;
+				eeprom_update_byte(&eemacros[macroslot][0],
+					args[2] ? args[1] : NO_KEY);
+				eeprom_update_byte(&eemacros[macroslot][1],
+					args[2] > MACRO_LENGTH ? MACRO_LENGTH : args[2]);
+			}
+			writechar(ACK_CODE);
+			break;
+		case COM_LED_EFFECT:
+			/* Effect, colours, then period. */
+			starteffect(args[0], args[1], args[2]);
+			break;
+		case COM_LED_BRIGHTNESS:
+			/* Red, green, then blue. */
+			for (unsigned char c = 0; c < LED_CHANNELS; c++)
+			{
+				unsigned char level = args[LED_CHANNELS - 1 - c];
+
+				ledlevels[c] = (level > MAX_LED_LEVEL ?
+					MAX_LED_LEVEL : level);
+				eeprom_update_byte(&eeledlevels[c], ledlevels[c]);
+			}
+			showleds();
+			writechar(ACK_CODE);
+			break;
+		case COM_REGISTERS:
+			/* Operation, register, then the count to read or the
+			 * value to write. */
+			if (args[0] == REG_SET)
+			{
+				setregister(args[1], args[2]);
+				sendregisters(args[1], 1);
+			}
+			else if (args[0] == REG_GET)
+				sendregisters(args[1], args[2]);
+			break;
+		default:
+			break;
+	}
+}
+
+/* Read a register. */
+unsigned char getregister(unsigned char reg)
+{
+	switch (reg)
+	{
+		case REG_VERSION:
+			return PROTOCOL_VERSION;
+		case REG_CAPABILITIES:
+			return CAPABILITIES;
+		case REG_DEBOUNCE:
+			return steadythresh;
+		case REG_SCAN_RATE:
+			return scanrate;
+		case REG_IDLE_TIMEOUT:
+			return idletimeout;
+		case REG_TYPEMATIC_DELAY:
+			return typematicdelay >> 2;
+		case REG_TYPEMATIC_RATE:
+			return typematicrate >> 2;
+		case REG_TYPEMATIC_MODE:
+			return typematicmode;
+		case REG_OUTPUT_MODE:
+			return outputmode;
+		case REG_FN_KEY:
+			return fnkey;
+		case REG_FN_MODE:
+			return fnmode;
+		case REG_LEDS:
+			return ledcolour;
+		case REG_FLOW_CONTROL:
+			return flowcontrol;
+		case REG_BAUD:
+			return UBRRL;
+		case REG_SCAN_BOOST:
+			return scanboost;
+		default:
+			return 0xff;
+	}
+}
+
+/* Write a register. The config registers are saved, like the config
+ * commands; the read only ones, and the output mode, which has its own
+ * commands, are left alone. */
+void setregister(unsigned char reg, unsigned char value)
+{
+	switch (reg)
+	{
+		case REG_DEBOUNCE:
+			setsteadythresh(value);
+			eeprom_update_byte(&eesteadythresh, steadythresh);
+			break;
+		case REG_SCAN_RATE:
+			setscanrate(value);
+			eeprom_update_byte(&eescanrate, scanrate);
+			break;
+		case REG_IDLE_TIMEOUT:
+			setidletimeout(value);
+			eeprom_update_byte(&eeidletimeout, idletimeout);
+			break;
+		case REG_SCAN_BOOST:
+			setscanboost(value);
+			eeprom_update_byte(&eescanboost, scanboost);
+			break;
+		case REG_TYPEMATIC_DELAY:
+			typematicdelay = (value & COM_VALUE_MASK) << 2;
+			break;
+		case REG_TYPEMATIC_RATE:
+			typematicrate = (value & COM_VALUE_MASK) << 2;
+			break;
+		case REG_TYPEMATIC_MODE:
+			if (value <= TYPEMATIC_BATCHED)
+				typematicmode = value;
+			break;
+		case REG_FN_KEY:
+			eeprom_update_byte(&eefnkey, value);
+			loadfnkey();
+			break;
+		case REG_FN_MODE:
+			eeprom_update_byte(&eefnmode, value);
+			loadfnkey();
+			break;
+		case REG_LEDS:
+			setleds(value);
+			break;
+		case REG_FLOW_CONTROL:
+			flowcontrol = (value != 0);
+			cli();
+			txpaused = 0;
+			TX_START();
+			sei();
+			setready(READY_EVENTS | READY_OUTPUT);
+			break;
+		default:
+			break;
+	}
+}
+
+/* Stop any LED effect and show a colour. */
+void setleds(unsigned char colour)
+{
+	ledeffect = EFFECT_NONE;
+	ledcolour = colour & LED_MASK;
+	ledscale = MAX_LED_LEVEL;
+	showleds();
+}
+
+/* Work out the bit planes for the colour showing, at each channel's level
+ * scaled by the effect's. */
+void showleds(void)
+{
+	unsigned char planes[BCM_BITS];
+
+	memset(planes, 0, BCM_BITS);
+	for (unsigned char c = 0; c < LED_CHANNELS; c++)
+	{
+		unsigned char level = ledlevels[c] * (ledscale + 1) >> BCM_BITS;
+
+		if (!(ledcolour & (1 << c)))
+			continue;
+		for (unsigned char b = 0; b < BCM_BITS; b++)
+		{
+			if (level & (1 << b))
+				planes[b] |= (1 << c);
+		}
+	}
+
+	memcpy(bcmplanes, planes, BCM_BITS);
+}
+
+/* Get the LED brightness from EEPROM; blank is full brightness. */
+void loadleds(void)
+{
+	for (unsigned char c = 0; c < LED_CHANNELS; c++)
+	{
+		unsigned char level = eeprom_read_byte(&eeledlevels[c]);
+
+		ledlevels[c] = (level > MAX_LED_LEVEL ? MAX_LED_LEVEL : level);
+	}
+	showleds();
+}
+
+/* Start an LED effect, showing colour A straight away. An unknown effect,
+ * or a zero period, just shows colour A. */
+void starteffect(unsigned char effect, unsigned char colours,
+	unsigned char period)
+{
+	setleds(colours);
+
+	if (effect > EFFECT_LAST || !period)
+		return;
+
+	ledcolours = colours;
+	ledperiod = period;
+	ledsteps = 0;
+	ledphase = 0;
+	ledcolour = colours & LED_MASK;
+	if (effect == EFFECT_FADE)
+	{
+		ledscale = 0;
+		showleds();
+	}
+	ledeffect = effect;
+}
+
+/* Move the LED effect on a step, changing the colour at the end of each
+ * period. */
+static inline void stepeffect(void)
+{
+	unsigned char a = ledcolours & LED_MASK;
+	unsigned char b = (ledcolours >> 4) & LED_MASK;
+
+	if (++ledsteps < ledperiod)
+		return;
+	ledsteps = 0;
+	ledphase++;
+
+	switch (ledeffect)
+	{
+		case EFFECT_BLINK:
+			ledcolour = (ledphase & 1) ? 0 : a;
+			break;
+		case EFFECT_ALTERNATE:
+			ledcolour = (ledphase & 1) ? b : a;
+			break;
+		case EFFECT_PULSE:
+			ledcolour = (ledphase & 3) ? 0 : a;
+			break;
+		case EFFECT_SEQUENCE:
+			/* Towards B, down if it's below A, then A again. */
+			if (ledcolour == b)
+				ledcolour = a;
+			else if (ledcolour < b)
+				ledcolour++;
+			else
+				ledcolour--;
+			break;
+		case EFFECT_FADE:
+			ledscale = ledphase & MAX_LED_LEVEL;
+			if (ledphase & (1 << BCM_BITS))
+				ledscale = MAX_LED_LEVEL - ledscale;
+			break;
+		default:
+			break;
+	}
+
+	showleds();
+}
+
+/* Send a run of registers. */
+void sendregisters(unsigned char first, unsigned char count)
+{
+	if (count > NUM_REGISTERS)
+		count = NUM_REGISTERS;
+
+	startframe();
+	writechar(REGISTERS_CODE);
+	writechar(first);
+	writechar(count);
+	for (unsigned char r = 0; r < count; r++)
+		writechar(getregister(first + r));
+	endframe();
+}
+
+/* If the event is a macro's trigger, start it (when going down, and
+ * nothing else is playing) and return 1. Macros are only played when the
+ * host is being sent events or characters. */
+unsigned char macroevent(unsigned char event)
+{
+	if (outputmode != OUTPUT_EVENTS && outputmode != OUTPUT_ASCII)
+		return 0;
+
+	for (unsigned char slot = 0; slot < MACRO_SLOTS; slot++)
+	{
+		if (eeprom_read_byte(&eemacros[slot][0]) !=
+			(event & 0b01111111))
+		{
+			continue;
+		}
+
+		if (!(event & 0b10000000) && !playlength)
+		{
+			playslot = slot;
+			playpos = 0;
+			playlength = eeprom_read_byte(&eemacros[slot][1]);
+			setready(READY_OUTPUT);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Send as much of the playing macro as the transmit buffer will take
+ * without waiting, so the main loop carries on while it plays. */
+void playmacro(void)
+{
+	while (playpos < playlength &&
+		((txwritepointer + 1) & (TX_BUFFER_SIZE - 1)) != txreadpointer)
+		writechar(eeprom_read_byte(&eemacros[playslot][playpos++ + 2]));
+
+	if (playpos >= playlength)
+		playlength = 0;
+}
+
+/* Map a key event through the Fn layer, if it is on and has the key, or
+ * else the keymap, keeping its direction. Special codes are left alone. */
+unsigned char remapevent(unsigned char event)
+{
+	unsigned char scancode = event & 0b01111111;
+	unsigned char bit = 1 << (scancode & 0x07);
+	unsigned char mapped = NO_KEY;
+
+	if (scancode >= SCANCODE_LIMIT)
+		return event;
+
+	if (!(event & 0b10000000))
+	{
+		/* Down: use the layer if it's on. */
+		if (layeron)
+			mapped = layerlookup(scancode);
+		if (mapped != NO_KEY)
+			layerkeys[scancode >> 3] |= bit;
+	}
+	else if (layerkeys[scancode >> 3] & bit)
+	{
+		/* Up, and it went down in the layer. */
+		mapped = layerlookup(scancode);
+		layerkeys[scancode >> 3] &= ~bit;
+	}
+
+	if (mapped == NO_KEY)
+		mapped = eeprom_read_byte(&eekeymap[scancode]);
+	if (mapped == NO_KEY)
+		mapped = pgm_read_byte(&keymap[scancode]);
+
+	return (event & 0b10000000) | mapped;
+}
+
+/* Find what a key sends in the Fn layer, or NO_KEY. */
+unsigned char layerlookup(unsigned char scancode)
+{
+	for (int e = 0; e < LAYER_ENTRIES; e++)
+	{
+		if (eeprom_read_byte(&eelayer[e][0]) == scancode)
+			return eeprom_read_byte(&eelayer[e][1]);
+	}
+
+	return NO_KEY;
+}
+
+/* If the event is for the Fn key, switch the layer and return 1. */
+unsigned char fnkeyevent(unsigned char event)
+{
+	if ((event & 0b01111111) != fnkey)
+		return 0;
+
+	if (fnmode == FN_TOGGLE)
+	{
+		if (!(event & 0b10000000))
+			layeron = !layeron;
+	}
+	else
+		layeron = !(event & 0b10000000);
+
+	return 1;
+}
+
+/* Get the Fn key and its mode from EEPROM. */
+void loadfnkey(void)
+{
+	fnkey = eeprom_read_byte(&eefnkey);
+	fnmode = eeprom_read_byte(&eefnmode);
+	layeron = 0;
+}
+
+/* Chord learning: collect the keys pressed until the first one is
+ * released, then save them as the chord. */
+void learnchord(unsigned char event)
+{
+	if (ISCHORD(event))
+		return;
+
+	if (!(event & 0b10000000))
+	{
+		if (learncount < CHORD_KEYS)
+			learnkeys[learncount++] = event;
+	}
+	else if (learncount)
+	{
+		memset(learnkeys + learncount, NO_KEY, CHORD_KEYS - learncount);
+		eeprom_update_block(learnkeys, eechords[learningchord - 1],
+			CHORD_KEYS);
+		learningchord = 0;
+		loadchords();
+	}
+}
+
+/* Returns the number of events waiting to be sent. */
+unsigned char eventbacklog(void)
+{
+	unsigned char pointerdiff;
+
+	cli();
+	pointerdiff = ((writepointer - readpointer) & (BUFFER_SIZE - 1)) +
+		((prioritywritepointer - priorityreadpointer) &
+		(PRIORITY_BUFFER_SIZE - 1));
+	sei();
+
+	return pointerdiff;
+}
+
+/* Put an event in the right buffer. Metas and chords go in the high
+ * priority one, so they aren't held up behind key ups, but only if nothing
+ * waiting in the main buffer would be read differently for it; otherwise,
+ * or if it's full, they queue with the rest. Called from the timer
+ * interrupt. Returns 0 if the buffer is full, so the event has to wait for
+ * a later scan. */
+static inline unsigned char queueevent(unsigned char event)
+{
+	unsigned char next;
+
+	if ((ISMETA(event) || ISCHORD(event)) && !keyorder)
+	{
+		next = (prioritywritepointer + 1) & (PRIORITY_BUFFER_SIZE - 1);
+		if (next != priorityreadpointer)
+		{
+			prioritybuffer[prioritywritepointer] = event;
+			prioritywritepointer = next;
+			readyflags |= READY_EVENTS;
+			return 1;
+		}
+	}
+
+	next = (writepointer + 1) & (BUFFER_SIZE - 1);
+	if (next == readpointer)
+		return 0;
+	keybuffer[writepointer] = event;
+	writepointer = next;
+	if (ORDERED(event))
+		keyorder++;
+	readyflags |= READY_EVENTS;
+	return 1;
+}
+
+/* Get a key's debounce threshold: its own, if it has been widened, or
+ * else the common one. */
+static inline unsigned char getthresh(unsigned char scancode)
+{
+	for (unsigned char w = 0; w < WIDE_KEYS; w++)
+	{
+		if (widekeys[w] == scancode)
+			return widethresh[w];
+	}
+
+	return steadythresh;
+}
+
+/* Set a key's debounce threshold. One no wider than the common threshold
+ * frees the key's entry. If there is no free entry the narrowest is taken,
+ * as long as it is narrower. */
+void setthresh(unsigned char scancode, unsigned char thresh)
+{
+	unsigned char entry = WIDE_KEYS;
+
+	for (unsigned char w = 0; w < WIDE_KEYS; w++)
+	{
+		if (widekeys[w] == scancode)
+		{
+			entry = w;
+			break;
+		}
+		if (entry == WIDE_KEYS || (widekeys[entry] != NO_KEY &&
+			(widekeys[w] == NO_KEY || widethresh[w] < widethresh[entry])))
+		{
+			entry = w;
+		}
+	}
+
+	if (thresh <= steadythresh)
+	{
+		if (widekeys[entry] == scancode)
+			widekeys[entry] = NO_KEY;
+	}
+	else if (widekeys[entry] == scancode || widekeys[entry] == NO_KEY ||
+		widethresh[entry] < thresh)
+	{
+		if (widekeys[entry] != scancode)
+			widegap[entry] = 0;
+		widekeys[entry] = scancode;
+		widethresh[entry] = thresh;
+	}
+}
+
+/* Keep the longest gap between bounces, for a key with its own threshold. */
+static inline void notegap(unsigned char scancode, unsigned char gap)
+{
+	for (unsigned char w = 0; w < WIDE_KEYS; w++)
+	{
+		if (widekeys[w] == scancode)
+		{
+			if (gap > widegap[w])
+				widegap[w] = gap;
+			break;
+		}
+	}
+}
+
+/* Find the key's debounce slot, or DEBOUNCE_SLOTS if it isn't being
+ * debounced. */
+static inline unsigned char debounceslot(unsigned char scancode)
+{
+	unsigned char slot;
+
+	for (slot = 0; slot < DEBOUNCE_SLOTS; slot++)
+	{
+		if (debouncekeys[slot] == scancode)
+			break;
+	}
+
+	return slot;
+}
+
+/* Start, or restart, the debounce counter for a key that has just changed.
+ * If the counter was already running the key is bouncing, so mark it. A gap
+ * between bounces that came close to the threshold widens it; the gap is
+ * counted in boosted scans, so is brought back to configured ones, rounding
+ * up. Returns 0 if there is no free slot, so the change has to wait. */
+static inline unsigned char startdebounce(unsigned char scancode)
+{
+	unsigned char slot = debounceslot(scancode);
+
+	if (slot < DEBOUNCE_SLOTS)
+	{
+		unsigned char gap = (debouncecounts[slot] & ~STEADY_BOUNCED) - 1;
+		unsigned char thresh = getthresh(scancode);
+
+		/* A key whose event was waiting for room in the buffer has
+		 * gone back to where it was, so the event is dropped. */
+		if (gap >= (thresh << scanboost))
+		{
+			unsigned char bit = 1 << (scancode & 0x07);
+
+			if (keystate[scancode >> 3] & bit)
+				steadystate[scancode >> 3] &= ~bit;
+			else
+				steadystate[scancode >> 3] |= bit;
+			debouncekeys[slot] = NO_KEY;
+			return 1;
+		}
+
+		gap = (gap + (1 << scanboost) - 1) >> scanboost;
+		if (gap + STEADY_MARGIN > thresh)
+		{
+			setthresh(scancode, gap + STEADY_MARGIN > MAX_STEADY_THRESH ?
+				MAX_STEADY_THRESH : gap + STEADY_MARGIN);
+		}
+		notegap(scancode, gap);
+		debouncecounts[slot] = STEADY_BOUNCED | 1;
+		return 1;
+	}
+
+	slot = debounceslot(NO_KEY);
+	if (slot == DEBOUNCE_SLOTS)
+		return 0;
+
+	debouncekeys[slot] = scancode;
+	debouncecounts[slot] = 1;
+	return 1;
+}
+
+/* The key has settled: count the press, and whether it bounced, and free
+ * its slot. When the press count fills up both counts are halved, and if
+ * this press was clean the key's threshold is relaxed. */
+static inline void enddebounce(unsigned char slot, unsigned char down)
+{
+	unsigned char scancode = debouncekeys[slot];
+	unsigned char bounced = debouncecounts[slot] & STEADY_BOUNCED;
+
+	if (down)
+	{
+		unsigned char stats = keystats[scancode];
+
+		if (stats >= 0xf0)
+		{
+			stats = (stats >> 1) & 0x77;
+			if (!bounced)
+				setthresh(scancode, getthresh(scancode) - 1);
+		}
+		keystats[scancode] = stats + (bounced ? 0x11 : 0x10);
+	}
+
+	debouncekeys[slot] = NO_KEY;
+}
+
+/* Command bytes arrive here, from the UART or SPI interrupt. Report
+ * requests are answered straight away, the report going out ahead of
+ * anything else waiting as soon as the frame being sent is finished, so the
+ * time taken doesn't depend on what the main loop is doing; the rest are
+ * queued for the main loop. Nothing is written to the transmit buffer from
+ * here, so no byte is ever lost for want of room in it. */
+static inline void receivecommand(unsigned char incommand)
+{
+	/* Flow control bytes are never commands or arguments. */
+	if (flowcontrol && (incommand == FLOW_XOFF || incommand == FLOW_XON))
+	{
+		txpaused = (incommand == FLOW_XOFF);
+		TX_START();
+		readyflags |= READY_EVENTS | READY_OUTPUT;
+	}
+	else if (incommand == COM_REPORT && !rxargs)
+	{
+		/* Unless the last one is still going, when the scan takes
+		 * another once it has. */
+		if (reportpos == REPORT_LENGTH)
+			makereport();
+		else
+			reportagain = 1;
+	}
+#ifndef SPI_TRANSPORT
+	else if (incommand == COM_AUTOBAUD && !rxargs)
+	{
+		/* Straight away, as the sync follows right behind. */
+		startautobaud(AUTOBAUD_COMMAND_MS);
+	}
+#endif
+	else
+	{
+		if (rxargs)
+		{
+			/* The last argument of COM_SET_MACRO is the number of
+			 * data bytes to follow. */
+			if (--rxargs == 0 && rxmacro)
+			{
+				rxargs = incommand;
+				rxmacro = 0;
+			}
+		}
+		else
+		{
+			rxargs = COMMAND_ARGS(incommand);
+			rxmacro = (incommand == COM_SET_MACRO);
+			commandstart = NO_KEY;
+		}
+
+		unsigned char next = (commandwritepointer + 1) &
+			(COMMAND_BUFFER_SIZE - 1);
+
+		if (commanddropping)
+		{
+			/* The rest of a dropped command. */
+		}
+		else if (next == commandreadpointer)
+		{
+			/* The buffer is full, so this command is dropped: the
+			 * part of it still waiting goes, making room for the
+			 * next, and the rest is thrown away as it arrives. If
+			 * one was already dropped, and the main loop hasn't
+			 * reached it yet, everything since goes with it. */
+			if (commandoverflow)
+				commandwritepointer = commandcut;
+			else if (commandstart != NO_KEY)
+			{
+				/* Part of it is stored. The main loop may have
+				 * taken some of that already, and is told to
+				 * give up on it when it reaches the cut. */
+				if (((commandstart - commandreadpointer) &
+					(COMMAND_BUFFER_SIZE - 1)) <
+					((commandwritepointer - commandreadpointer) &
+					(COMMAND_BUFFER_SIZE - 1)))
+				{
+					commandwritepointer = commandstart;
+				}
+				else
+					commandwritepointer = commandreadpointer;
+			}
+			commandcut = commandwritepointer;
+			commandoverflow = 1;
+			commanddropping = 1;
+		}
+		else
+		{
+			if (commandstart == NO_KEY)
+				commandstart = commandwritepointer;
+			commandbuffer[commandwritepointer] = incommand;
+			commandwritepointer = next;
+		}
+		if (!rxargs)
+			commanddropping = 0;
+		readyflags |= READY_COMMANDS;
+	}
+}
+
+#ifdef SPI_TRANSPORT
+/* A byte has been clocked in. Deal with it, so a report asked for goes out
+ * straight away, then load the next byte before the host clocks again. */
+ISR(SPI_STC_vect)
+{
+	unsigned char incommand = SPDR;
+	unsigned char c;
+
+	/* SPI_IDLE is only a poll between commands; as an argument it is
+	 * NO_KEY. */
+	if (incommand != SPI_IDLE || rxargs)
+		receivecommand(incommand);
+
+	SPDR = nexttxbyte(&c) ? c : SPI_IDLE;
+}
+#else
+ISR(USART_RX_vect)
+{
+	receivecommand(UDR);
+}
+#endif
+
+/* Look for changes in a bank of columns, as read by the scan, queueing it
+ * in raw mode and starting the debounce for keys which have changed.
+ * Returns 1 if any key changed. */
+unsigned char scanbank(unsigned char in, unsigned char mask,
+	unsigned char bank, unsigned char base)
+{
+	unsigned char active = 0;
+	unsigned char instrobe = 1;
+	unsigned char *state = &keystate[base >> 3];
+
+	/* Raw mode: queue the bank if it has changed since it was last
+	 * queued. If there is no room it stays different, so it is tried
+	 * again next scan. */
+	if (outputmode == OUTPUT_RAW)
+	{
+		unsigned char raw = in & mask;
+
+		if ((raw != rawlast[bank] || (rawdirty & (1U << bank))) &&
+			((rawwritepointer + 2) & (RAW_BUFFER_SIZE - 1)) !=
+			rawreadpointer)
+		{
+			rawbuffer[rawwritepointer] = RAW_CODE | bank;
+			rawbuffer[rawwritepointer + 1] = raw;
+			rawwritepointer = (rawwritepointer + 2) &
+				(RAW_BUFFER_SIZE - 1);
+			readyflags |= READY_OUTPUT;
+			rawlast[bank] = raw;
+			rawdirty &= ~(1U << bank);
+		}
+	}
+
+	for (unsigned char col = 0; col < 8; col++, instrobe <<= 1)
+	{
+		unsigned char scancode = base | col;
+
+		/* Skip columns this bank doesn't have. */
+		if (!(mask & instrobe))
+			continue;
+
+		/* Start the debouncing counter for a key which has
+		 * changed, if there is a slot for it. If there isn't
+		 * the change is seen again next scan. */
+		if (!(in & instrobe))
+		{
+			/* Key down */
+			if (!(*state & instrobe))
+			{
+				active = 1;
+				if (startdebounce(scancode))
+					*state |= instrobe;
+			}
+		}
+		else
+		{
+			/* Key up */
+			if (*state & instrobe)
+			{
+				active = 1;
+				if (startdebounce(scancode))
+					*state &= ~instrobe;
+			}
+		}
+	}
+
+	return active;
+}
+
+/* Wait for the timer to reach the phase, measured from the start of the
+ * scan period, by way of OCR1B. If it has already gone, don't wait. */
+static inline void waitphase(unsigned int phase)
+{
+	OCR1B = phase;
+	TIFR = (1 << OCF1B);
+	if (TCNT1 < phase)
+		while (!(TIFR & (1 << OCF1B)));
+}
+
+/* The thing that makes it all work: timer interrupt. */
+ISR(TIMER1_COMPA_vect)
+{
+	unsigned char active = 0;
+	unsigned char samples[NUM_BANKS];
+	unsigned int phase = CYCLE_TICKS(SCAN_START_CYCLES) -
+		CYCLE_TICKS(ROW_GAP_CYCLES);
+
+	/* The scan takes longer than the shortest LED brightness plane, so
+	 * Timer0, and the UART sending, are let in while it runs, though not
+	 * while a row is driven, so they can't move its sample time. Nothing
+	 * else is: the scan mustn't run over itself, and the RX interrupt
+	 * shares the buffers. */
+	TIMSK &= ~(1 << OCIE1A);
+	RX_OFF();
+	sei();
+
+	/* First read every row. Each is read when OCR1B matches, a fixed time
+	 * after the start of the scan, so the moment a row is sampled doesn't
+	 * depend on the path the code took to get there. That time allows for
+	 * getting here and for the code between rows, but a row is never read
+	 * before its settle time is up. This is unrolled from the matrix
+	 * layout. */
+#define SAMPLE_BANK(bank, row, port, mask, base) \
+	if ((row) == thisrow) \
+		samples[bank] = PIN##port;
+#define SAMPLE_ROW(row, port, bits) \
+	{ \
+		const unsigned char thisrow = (row); \
+		unsigned int settled; \
+		cli(); \
+		DDR##port |= (bits); \
+		settled = TCNT1 + settleticks[row]; \
+		phase += CYCLE_TICKS(ROW_GAP_CYCLES) + settleticks[row]; \
+		waitphase(phase > settled ? phase : settled); \
+		MATRIX_BANKS(SAMPLE_BANK) \
+		DDR##port &= (unsigned char) ~(bits); \
+		sei(); \
+	}
+	MATRIX_ROWS(SAMPLE_ROW)
+
+	/* Then work through what was read, a bank at a time. This is
+	 * unrolled from the layout too, so each bank's details are
+	 * constants. */
+#define SCAN_BANK(bank, row, port, mask, base) \
+	active |= scanbank(samples[bank], (mask), (bank), (base));
+	MATRIX_BANKS(SCAN_BANK)
+
+	/* Count for the keys being debounced. */
+	for (unsigned char slot = 0; slot < DEBOUNCE_SLOTS; slot++)
+	{
+		unsigned char scancode = debouncekeys[slot];
+
+		if (scancode == NO_KEY)
+			continue;
+		active = 1;
+
+		if ((debouncecounts[slot] & ~STEADY_BOUNCED) >
+			(getthresh(scancode) << scanboost))
+		{
+			/* Key is "stuck" up, or down? Generate an event. If
+			 * there's no room for it the key keeps its slot and
+			 * tries again next scan, so no event is lost; it has
+			 * settled all the same. */
+			unsigned char bit = 1 << (scancode & 0x07);
+			unsigned char down = (keystate[scancode >> 3] & bit) != 0;
+
+			if (down)
+				steadystate[scancode >> 3] |= bit;
+			else
+				steadystate[scancode >> 3] &= ~bit;
+			if (queueevent(down ? scancode : scancode | 0b10000000))
+				enddebounce(slot, down);
+		}
+		else
+		{
+			/* Counter is running, so count! */
+			debouncecounts[slot]++;
+		}
+	}
+
+	/* Scan rate. Any key changing or bouncing boosts it straight away;
+	 * once they have all settled it goes back to the configured rate, and
+	 * a long enough quiet spell drops it to the idle rate. */
+	unsigned int ocr;
+
+	if (active)
+	{
+		quietscans = 0;
+		scanidle = 0;
+		ocr = activeocr;
+	}
+	else
+	{
+		if (idlescans && !scanidle && scanrate > IDLE_SCAN_RATE &&
+			++quietscans >= idlescans)
+		{
+			scanidle = 1;
+		}
+		ocr = scanidle ? SCAN_OCR(IDLE_SCAN_RATE) : scanocr;
+	}
+
+	/* If the count is already past a shorter period, start the next one
+	 * now rather than after the timer wraps. */
+	if (OCR1A != ocr)
+	{
+		OCR1A = ocr;
+		if (TCNT1 >= ocr)
+			TCNT1 = 0;
+	}
+
+	/* Check the system chords against the settled keys. The signal line
+	 * is held low while any chord is down, whatever is waiting to be
+	 * sent; the host is also told which chord it was, when there is room
+	 * for the event. */
+	unsigned char nowheld = 0;
+
+	for (int c = 0; c < NUM_CHORDS; c++)
+	{
+		unsigned char held = (chords[c][0] != NO_KEY);
+
+		for (int k = 0; k < CHORD_KEYS && held; k++)
+		{
+			unsigned char scancode = chords[c][k];
+
+			if (scancode & 0b10000000)
+				break;
+			if (!KEYDOWN(scancode))
+				held = 0;
+		}
+
+		if (held)
+			nowheld |= (1 << c);
+	}
+
+	chordsheld = nowheld;
+
+	if (chordsheld)
+		PORTD &= ~SIGNAL_BIT;
+	else
+		PORTD |= SIGNAL_BIT;
+
+	/* A change which doesn't fit is sent on a later scan. */
+	for (int c = 0; c < NUM_CHORDS; c++)
+	{
+		unsigned char held = chordsheld & (1 << c);
+
+		if (((chordssent ^ chordsheld) & (1 << c)) &&
+			queueevent(CHORD_CODE | c | (held ? 0 : 0b10000000)))
+		{
+			chordssent ^= (1 << c);
+		}
+	}
+
+	cli();
+
+	/* A report asked for while the last was going out. */
+	if (reportagain && reportpos == REPORT_LENGTH)
+	{
+		reportagain = 0;
+		makereport();
+	}
+
+	RX_ON();
+	TIMSK |= (1 << OCIE1A);
+}
+
+/* LED brightness: show the next bit plane, and time it. The timer runs
+ * free, so each plane is timed from when it should have started. If
+ * something held this up past that, the plane is timed from now instead. */
+ISR(TIMER0_COMP_vect)
+{
+	unsigned char ticks = BCM_TICKS << bcmbit;
+	unsigned char count;
+
+	PORTE = bcmplanes[bcmbit];
+
+	if ((unsigned char) (TCNT0 - OCR0) >= ticks)
+		OCR0 = TCNT0 + ticks;
+	else
+		OCR0 += ticks;
+
+	bcmbit = (bcmbit + 1) & (BCM_BITS - 1);
+
+	/* Keep the tasks' ms clock, from how far the timer has actually got
+	 * since last time, so a late plane or a retimed one doesn't lose
+	 * time. This runs at least every plane, well inside the timer's
+	 * 256 ticks. */
+	count = TCNT0;
+	msticks += (unsigned char) (count - clocklast) << 3;
+	clocklast = count;
+	while (msticks >= MS_TICKS)
+	{
+		msticks -= MS_TICKS;
+		mstime++;
 	}
 }